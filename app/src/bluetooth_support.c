@@ -1,5 +1,8 @@
+#include "app/latency_stats.h"
 #include "app/posture_detection.h"
+#include "app/power_stats.h"
 #include "app/telemetry_storage.h"
+#include "app/trace_recorder.h"
 #include "services/nus/nus_internal.h"
 #include "zephyr/bluetooth/addr.h"
 #include "zephyr/bluetooth/bluetooth.h"
@@ -11,8 +14,11 @@
 #include "zephyr/kernel.h"
 #include "zephyr/logging/log.h"
 #include "zephyr/settings/settings.h"
+#include "zephyr/sys/atomic.h"
+#include "zephyr/sys/byteorder.h"
 
 #include "app/bluetooth_support.h"
+#include "app/command_protocol.h"
 
 LOG_MODULE_REGISTER(bt_support, LOG_LEVEL_DBG);
 
@@ -23,19 +29,11 @@ enum bt_adv_type { BT_ADV_NONE, BT_ADV_OPEN, BT_ADV_DIR };
 #define POSTURE_NOTIF ((const uint8_t[]){'N', 'P'})
 #define MOVEMENT_NOTIF ((const uint8_t[]){'N', 'M'})
 #define STATE_MARKER ((const uint8_t)'S')
-#define SETTINGS_RESP_MARKER ((const uint8_t)'U')
 
 #define TRANSFER_DONE_MARKER ((const uint8_t[]){'T', 'D'})
-
-#define STATE_REQ_MARKER ((const uint8_t[]){'R', 'S'})
-#define SETTINGS_REQ_MARKER ((const uint8_t[]){'R','U'})
-#define SETTINGS_MARKER ((const uint8_t[]){'S'})
-#define SETTING_CALIBRATION ((const uint8_t[]){'C'})
-#define SETTING_WORKING_MARKER ((const uint8_t[]){'W'})
-#define SETTING_TIMEOUT_MARKER ((const uint8_t[]){'T'})
-#define SETTING_RANGE_MARKER ((const uint8_t[]){'R'})
-
-#define TELEMETRY_MARKER ((const uint8_t[]){'T', 'E', 'L', 'E', 'M'})
+#define TRANSFER_STATS_MARKER ((const uint8_t[]){'T', 'S'})
+#define SYNC_DONE_MARKER ((const uint8_t[]){'S', 'D'})
+#define RECORD_DONE_MARKER ((const uint8_t[]){'R', 'D'})
 
 static const struct bt_data ad[] = {
     BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
@@ -62,6 +60,73 @@ static bool get_paired_peer(bt_addr_le_t *bond_addr) {
 	return bt_addr_le_cmp(bond_addr, BT_ADDR_LE_NONE) != 0;
 }
 
+/*
+ * Advertising backoff: fast right after boot, disconnect or a wake-up
+ * request, then slower, and finally duty-cycled windows at the slowest
+ * interval. update_advertisement_work is rescheduled for the next step.
+ */
+struct adv_stage {
+	uint32_t interval_ms;
+	uint32_t duration_s;
+};
+
+static const struct adv_stage adv_stages[] = {
+    {CONFIG_APP_BT_ADV_FAST_INTERVAL_MS, CONFIG_APP_BT_ADV_FAST_DURATION_S},
+    {CONFIG_APP_BT_ADV_MEDIUM_INTERVAL_MS, CONFIG_APP_BT_ADV_MEDIUM_DURATION_S},
+    {CONFIG_APP_BT_ADV_SLOW_INTERVAL_MS, 0},
+};
+
+static int64_t adv_backoff_ts;
+static uint32_t bt_adv_interval_ms;
+
+static void update_advertising_callback(struct k_work *work);
+POWER_STATS_HANDLER_DECLARE(update_advertising_callback)
+static K_WORK_DELAYABLE_DEFINE(update_advertisement_work,
+			       POWER_STATS_HANDLER(update_advertising_callback));
+
+/* Interval to advertise with now, 0 while outside an advertising window. */
+static uint32_t adv_schedule(int64_t *next_change_ms) {
+	int64_t elapsed_ms = k_uptime_get() - adv_backoff_ts;
+	for (size_t i = 0; i < ARRAY_SIZE(adv_stages) - 1; i++) {
+		int64_t duration_ms = adv_stages[i].duration_s * MSEC_PER_SEC;
+		if (elapsed_ms < duration_ms) {
+			*next_change_ms = duration_ms - elapsed_ms;
+			return adv_stages[i].interval_ms;
+		}
+		elapsed_ms -= duration_ms;
+	}
+
+	const struct adv_stage *last = &adv_stages[ARRAY_SIZE(adv_stages) - 1];
+	if (CONFIG_APP_BT_ADV_WINDOW_PERIOD_S == 0) {
+		*next_change_ms = -1;
+		return last->interval_ms;
+	}
+	int64_t period_ms = CONFIG_APP_BT_ADV_WINDOW_PERIOD_S * MSEC_PER_SEC;
+	int64_t window_ms = CONFIG_APP_BT_ADV_WINDOW_S * MSEC_PER_SEC;
+	int64_t phase_ms = elapsed_ms % period_ms;
+	if (phase_ms < window_ms) {
+		*next_change_ms = window_ms - phase_ms;
+		return last->interval_ms;
+	}
+	*next_change_ms = period_ms - phase_ms;
+	return 0;
+}
+
+static int adv_start(uint32_t interval_ms) {
+	uint32_t interval = interval_ms * 8 / 5; /* 0.625 ms units */
+	/* 12.5% of slack for the controller, within the legacy 10.24 s limit */
+	uint32_t interval_max = MIN(interval + interval / 8, BT_GAP_ADV_MAX_INTERVAL);
+	struct bt_le_adv_param param =
+	    BT_LE_ADV_PARAM_INIT(BT_LE_ADV_OPT_CONN, interval, interval_max, NULL);
+	int err = bt_le_adv_start(&param, ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
+	if (err) {
+		LOG_ERR("Advertising failed to start (err %d)", err);
+		return err;
+	}
+	bt_adv_interval_ms = interval_ms;
+	return 0;
+}
+
 static int update_advertisement(void) {
 	enum bt_adv_type desired_adv_type = BT_ADV_NONE;
 
@@ -78,12 +143,26 @@ static int update_advertisement(void) {
 		}
 	}
 
-	LOG_INF("Changing adv state from %d to %d", bt_adv_state, desired_adv_type);
+	int64_t next_change_ms = -1;
+	uint32_t interval_ms = 0;
+	if (desired_adv_type != BT_ADV_NONE) {
+		interval_ms = adv_schedule(&next_change_ms);
+		if (interval_ms == 0) {
+			// Between two advertising windows
+			desired_adv_type = BT_ADV_NONE;
+		}
+		k_work_reschedule(&update_advertisement_work,
+				  next_change_ms < 0 ? K_FOREVER : K_MSEC(next_change_ms));
+	}
 
-	if (desired_adv_type == bt_adv_state) {
+	if (desired_adv_type == bt_adv_state &&
+	    (desired_adv_type == BT_ADV_NONE || interval_ms == bt_adv_interval_ms)) {
 		return 0;
 	}
 
+	LOG_INF("Changing adv state from %d to %d, interval %u ms", bt_adv_state,
+		desired_adv_type, interval_ms);
+
 	if (bt_adv_state != BT_ADV_NONE) {
 		int err = bt_le_adv_stop();
 		if (err) {
@@ -105,16 +184,14 @@ static int update_advertisement(void) {
 		// struct bt_le_adv_param adv_param = *BT_LE_ADV_CONN_DIR_LOW_DUTY(&peer_address);
 		// adv_param.options |= BT_LE_ADV_OPT_DIR_ADDR_RPA;
 		// int err = bt_le_adv_start(&adv_param, NULL, 0, NULL, 0);
-		int err = bt_le_adv_start(BT_LE_ADV_CONN_FAST_1, ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
+		int err = adv_start(interval_ms);
 		if (err) {
-			LOG_ERR("Advertising failed to start (err %d)", err);
 			return err;
 		}
 		bt_adv_state = BT_ADV_DIR;
 	} else if (desired_adv_type == BT_ADV_OPEN) {
-		int err = bt_le_adv_start(BT_LE_ADV_CONN_FAST_1, ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
+		int err = adv_start(interval_ms);
 		if (err) {
-			LOG_ERR("Advertising failed to start (err %d)", err);
 			return err;
 		}
 		bt_adv_state = BT_ADV_OPEN;
@@ -126,7 +203,72 @@ static void update_advertising_callback(struct k_work *work) {
 	(void)work;
 	(void)update_advertisement();
 }
-K_WORK_DEFINE(update_advertisement_work, &update_advertising_callback);
+
+POWER_STATS_HANDLER_DEFINE(POWER_STATS_ADVERTISING, update_advertising_callback)
+
+void bluetooth_support_wake_advertising(void) {
+	adv_backoff_ts = k_uptime_get();
+	k_work_reschedule(&update_advertisement_work, K_NO_WAIT);
+}
+
+/*
+ * Connection parameter policy. Idle links ask for a long interval with
+ * peripheral latency; bulk transfers switch to the shortest interval and
+ * drop back once they are done. The time spent in each mode is accumulated
+ * for correlating with battery drain.
+ */
+enum conn_mode { CONN_MODE_IDLE, CONN_MODE_FAST, CONN_MODE_COUNT };
+
+#define CONN_IDLE_INTERVAL (CONFIG_APP_BT_IDLE_INTERVAL_MS * 4 / 5) /* 1.25 ms units */
+/* Survive three missed anchor points of the slave latency window */
+#define CONN_IDLE_TIMEOUT                                                                          \
+	((1 + CONFIG_APP_BT_IDLE_LATENCY) * CONFIG_APP_BT_IDLE_INTERVAL_MS * 3 / 10)
+
+BUILD_ASSERT(CONN_IDLE_TIMEOUT <= 3200, "Idle supervision timeout exceeds 32 s");
+
+/* Let discovery and pairing finish on the central's fast interval first */
+#define CONN_IDLE_DELAY_MS 5000
+
+static const struct bt_le_conn_param conn_mode_params[CONN_MODE_COUNT] = {
+    [CONN_MODE_IDLE] = BT_LE_CONN_PARAM_INIT(CONN_IDLE_INTERVAL, CONN_IDLE_INTERVAL,
+					     CONFIG_APP_BT_IDLE_LATENCY,
+					     MAX(CONN_IDLE_TIMEOUT, 400)),
+    [CONN_MODE_FAST] = BT_LE_CONN_PARAM_INIT(6, 12, 0, 400),
+};
+
+static struct {
+	enum conn_mode mode;
+	int64_t mode_ts;
+	uint64_t time_ms[CONN_MODE_COUNT];
+	uint16_t interval;
+	uint16_t latency;
+} conn_policy;
+
+static void conn_policy_account(void) {
+	int64_t now = k_uptime_get();
+	conn_policy.time_ms[conn_policy.mode] += now - conn_policy.mode_ts;
+	conn_policy.mode_ts = now;
+}
+
+static void conn_policy_set(enum conn_mode mode) {
+	k_mutex_lock(&bt_conn_mutex, K_FOREVER);
+	if (bt_conn == NULL || mode == conn_policy.mode) {
+		k_mutex_unlock(&bt_conn_mutex);
+		return;
+	}
+	conn_policy_account();
+	conn_policy.mode = mode;
+	int err = bt_conn_le_param_update(bt_conn, &conn_mode_params[mode]);
+	k_mutex_unlock(&bt_conn_mutex);
+	LOG_INF("Connection mode %d requested (err %d)", mode, err);
+}
+
+static void conn_idle_handler(struct k_work *work) {
+	(void)work;
+	conn_policy_set(CONN_MODE_IDLE);
+}
+
+static K_WORK_DELAYABLE_DEFINE(conn_idle_work, conn_idle_handler);
 
 static void le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency,
 			     uint16_t timeout) {
@@ -135,6 +277,8 @@ static void le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t l
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 
 	LOG_DBG("%s: interval %d latency %d timeout %d", addr, interval, latency, timeout);
+	conn_policy.interval = interval;
+	conn_policy.latency = latency;
 }
 
 static void connected(struct bt_conn *conn, uint8_t err) {
@@ -154,12 +298,19 @@ static void connected(struct bt_conn *conn, uint8_t err) {
 	// Bt advertisement has been stopped
 	bt_adv_state = BT_ADV_NONE;
 	bt_conn = bt_conn_ref(conn);
+	conn_policy.mode = CONN_MODE_FAST;
+	conn_policy.mode_ts = k_uptime_get();
+	conn_policy.interval = info.le.interval;
+	conn_policy.latency = info.le.latency;
 	k_mutex_unlock(&bt_conn_mutex);
+	k_work_reschedule(&conn_idle_work, K_MSEC(CONN_IDLE_DELAY_MS));
 
 	LOG_INF("Connected %s", addr);
 	(void)update_advertisement();
 }
 
+static void bulk_transfer_abort(void);
+
 static void disconnected(struct bt_conn *conn, uint8_t reason) {
 	char addr[BT_ADDR_LE_STR_LEN];
 
@@ -167,12 +318,15 @@ static void disconnected(struct bt_conn *conn, uint8_t reason) {
 	k_mutex_lock(&bt_conn_mutex, K_FOREVER);
 	bt_conn_unref(bt_conn);
 	bt_conn = NULL;
+	conn_policy_account();
 	k_mutex_unlock(&bt_conn_mutex);
+	k_work_cancel_delayable(&conn_idle_work);
+	bulk_transfer_abort();
 	LOG_INF("Disconnected from %s, reson BT_HCI_ERR_ %d", addr, reason);
 
 	// Update ad as work because bluetooth connection state isn't updated
 	// here
-	(void)k_work_submit(&update_advertisement_work);
+	bluetooth_support_wake_advertising();
 }
 
 static void security_changed(struct bt_conn *conn, bt_security_t level, enum bt_security_err err) {
@@ -233,11 +387,13 @@ static struct bt_conn_auth_info_cb ble_auth_info_cb_display = {
     .pairing_complete = &auth_pairing_complete,
 };
 
-static void bluetooth_send_buf(const uint8_t *buf, size_t len, bt_gatt_complete_func_t callback) {
+static int bluetooth_send_buf_cb(const uint8_t *buf, size_t len, bt_gatt_complete_func_t callback,
+				 void *user_data) {
 	if (bt_conn == NULL) {
 		LOG_INF("No connection, not sending data");
-		return;
+		return -ENOTCONN;
 	}
+	int err = -EACCES;
 	k_mutex_lock(&bt_conn_mutex, K_FOREVER);
 	if (is_secure_enough(bt_conn)) {
 		// Workaround for filling up all tx pool
@@ -247,117 +403,482 @@ static void bluetooth_send_buf(const uint8_t *buf, size_t len, bt_gatt_complete_
 		    .data = buf,
 		    .len = len,
 		    .func = callback,
+		    .user_data = user_data,
 		};
-		int err = bt_gatt_notify_cb(bt_conn, &gatt_params);
-		if (err != 0) {
+		err = bt_gatt_notify_cb(bt_conn, &gatt_params);
+		if (err == -ENOMEM || err == -ENOBUFS) {
+			// Back-pressure, pipelined senders retry once a buffer frees up
+			LOG_DBG("No TX buffer for %zu bytes", len);
+		} else if (err != 0) {
 			LOG_ERR("Failed to send data (err %d)", err);
 		} else {
 			LOG_DBG("Sent %zu bytes", len);
+			power_stats_count(POWER_STATS_BT_TX);
 		}
 	}
 	k_mutex_unlock(&bt_conn_mutex);
+	return err;
 }
 
-static void bluetooth_support_notify_settings(void) {
-	struct posture_settings settings = posture_detection_get_settings();
-	uint8_t buf[sizeof(SETTINGS_RESP_MARKER) + sizeof settings] = {SETTINGS_RESP_MARKER};
-	memcpy(buf + sizeof(SETTINGS_RESP_MARKER), &settings, sizeof settings );
-	bluetooth_send_buf(buf, sizeof buf, NULL);
+static int bluetooth_send_buf(const uint8_t *buf, size_t len, bt_gatt_complete_func_t callback) {
+	return bluetooth_send_buf_cb(buf, len, callback, NULL);
 }
 
-static void parse_setting_payload(const uint8_t *data, size_t len) {
-	size_t offset = 0;
-	while (len > offset) {
-		if (len - offset < sizeof(SETTING_CALIBRATION)) {
-			LOG_ERR("Invalid settings payload");
-			return;
-		}
-		if (memcmp(data + offset, SETTING_CALIBRATION, sizeof(SETTING_CALIBRATION)) == 0) {
-			LOG_INF("Calibration settings received");
-			offset += sizeof(SETTING_CALIBRATION);
-			posture_detection_do_calibration();
-		} else {
-			if (len - offset < sizeof(SETTING_TIMEOUT_MARKER) + 1) {
-				LOG_ERR("Invalid settings value");
-				return;
-			}
-			if (memcmp(data + offset, SETTING_TIMEOUT_MARKER,
-				   sizeof(SETTING_TIMEOUT_MARKER)) == 0) {
-				offset += sizeof(SETTING_TIMEOUT_MARKER);
-				LOG_INF("Timeout marker settings received %d", data[offset]);
-				posture_detection_set_timeout(data[offset]);
-				offset++;
-			} else if (memcmp(data + offset, SETTING_WORKING_MARKER,
-					  sizeof(SETTING_WORKING_MARKER)) == 0) {
-				LOG_INF("Working marker settings received %d", data[offset]);
-				offset += sizeof(SETTING_WORKING_MARKER);
-				posture_detection_set_enabled(data[offset]);
-				offset++;
-			} else if (memcmp(data + offset, SETTING_RANGE_MARKER,
-					  sizeof(SETTING_RANGE_MARKER)) == 0) {
-				LOG_INF("Range marker settings received %d", data[offset]);
-				offset += sizeof(SETTING_RANGE_MARKER);
-				posture_detection_set_working_range(data[offset]);
-				offset++;
-			} else {
-				LOG_ERR("Unknown setting marker");
-				return;
-			}
-		}
+static void bulk_transfer_callback(struct bt_conn *, void *);
+
+/* Reads the next portion into buf, returns 1 once the source is exhausted. */
+typedef int (*bulk_transfer_read_t)(uint8_t *buf, size_t *len);
+/* Rewinds the source, called from the work item before the first read. */
+typedef void (*bulk_transfer_begin_t)(void);
+
+/*
+ * Streams a source as notifications of up to ATT MTU - 3 bytes, keeping up to
+ * CONFIG_APP_BT_BULK_IN_FLIGHT of them queued in the stack. bt_gatt_notify_cb()
+ * copies the payload, so one staging buffer is enough; a chunk refused for
+ * lack of TX buffers stays staged until a completion frees one.
+ *
+ * Every transfer gets a new generation, passed to the completions as user
+ * data. Completions of notifications queued by an aborted or earlier transfer
+ * may still arrive after a new one started and must not touch its count.
+ */
+struct bulk_transfer_work {
+	struct k_work_delayable work;
+	unsigned piece;
+	bulk_transfer_begin_t begin;
+	bulk_transfer_read_t read;
+	const uint8_t *done_marker;
+	size_t done_marker_len;
+
+	bool active;
+	bool exhausted;
+	atomic_t generation;
+	atomic_t in_flight;
+	size_t staged_len;
+	uint8_t buf[CONFIG_BT_L2CAP_TX_MTU - 3];
+
+	int64_t start_ts;
+	uint32_t bytes;
+};
+
+#define BULK_TRANSFER_RETRY_MS 10
+
+static struct bulk_transfer_work transfer_work;
+
+static size_t bulk_chunk_len(void) {
+	size_t len = sizeof(transfer_work.buf);
+	k_mutex_lock(&bt_conn_mutex, K_FOREVER);
+	if (bt_conn != NULL) {
+		len = MIN(len, bt_gatt_get_mtu(bt_conn) - 3);
 	}
-	posture_detection_save_settings();
-	bluetooth_support_notify_settings();
+	k_mutex_unlock(&bt_conn_mutex);
+	return len;
 }
 
-static void transfer_telemetry_callback(struct bt_conn *, void *);
+/* Ask for 2M PHY and maximum length data PDUs while the transfer runs. */
+static void bulk_transfer_set_fast_link(bool fast) {
+	k_mutex_lock(&bt_conn_mutex, K_FOREVER);
+	if (bt_conn == NULL) {
+		k_mutex_unlock(&bt_conn_mutex);
+		return;
+	}
+#ifdef CONFIG_BT_USER_PHY_UPDATE
+	int phy_err = bt_conn_le_phy_update(bt_conn, fast ? BT_CONN_LE_PHY_PARAM_2M
+							  : BT_CONN_LE_PHY_PARAM_1M);
+	if (phy_err != 0) {
+		LOG_WRN("PHY update failed (err %d)", phy_err);
+	}
+#endif
+#ifdef CONFIG_BT_USER_DATA_LEN_UPDATE
+	int dl_err = bt_conn_le_data_len_update(bt_conn, fast ? BT_LE_DATA_LEN_PARAM_MAX
+							      : BT_LE_DATA_LEN_PARAM_DEFAULT);
+	if (dl_err != 0) {
+		LOG_WRN("Data length update failed (err %d)", dl_err);
+	}
+#endif
+	k_mutex_unlock(&bt_conn_mutex);
+}
 
-struct telemetry_transfer_work {
-	struct k_work work;
-	unsigned piece;
-};
+static void finish_bulk_transfer(struct bulk_transfer_work *transfer) {
+	transfer->active = false;
+	bluetooth_send_buf(transfer->done_marker, transfer->done_marker_len, NULL);
+
+	uint32_t elapsed_ms = k_uptime_get() - transfer->start_ts;
+	LOG_INF("Done bulk transfer, %u bytes in %u ms (%u B/s)", transfer->bytes, elapsed_ms,
+		elapsed_ms ? (uint32_t)((uint64_t)transfer->bytes * MSEC_PER_SEC / elapsed_ms) : 0);
+	uint8_t stats[sizeof(TRANSFER_STATS_MARKER) + 2 * sizeof(uint32_t)];
+	memcpy(stats, TRANSFER_STATS_MARKER, sizeof(TRANSFER_STATS_MARKER));
+	sys_put_le32(transfer->bytes, stats + sizeof(TRANSFER_STATS_MARKER));
+	sys_put_le32(elapsed_ms, stats + sizeof(TRANSFER_STATS_MARKER) + sizeof(uint32_t));
+	bluetooth_send_buf(stats, sizeof stats, NULL);
+
+	bulk_transfer_set_fast_link(false);
+	k_work_reschedule(&conn_idle_work, K_MSEC(CONN_IDLE_DELAY_MS));
+}
 
-static void transfer_telemetry(struct k_work *work) {
-	(void)work;
-	struct telemetry_transfer_work *telemetry_trans =
-	    CONTAINER_OF(work, struct telemetry_transfer_work, work);
-	static uint8_t telemetry_buf[500];
-	telemetry_buf[0] = telemetry_trans->piece;
-	telemetry_trans->piece++;
-	size_t len = sizeof(telemetry_buf) - 1;
-	int err = telemetry_get_portion(telemetry_buf + 1, &len);
-	if (err < 0) {
-		LOG_ERR("Failed to get telemetry portion (err %d)", err);
-		bluetooth_send_buf(TRANSFER_DONE_MARKER, sizeof(TRANSFER_DONE_MARKER), NULL);
+static void bulk_transfer(struct k_work *work) {
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	struct bulk_transfer_work *transfer = CONTAINER_OF(dwork, struct bulk_transfer_work, work);
+	if (!transfer->active) {
 		return;
 	}
-	if (err == 1 && len == 0) {
-		LOG_INF("Done telemetry transfer");
-		bluetooth_send_buf(TRANSFER_DONE_MARKER, sizeof(TRANSFER_DONE_MARKER), NULL);
+	if (transfer->begin != NULL) {
+		transfer->begin();
+		transfer->begin = NULL;
+	}
+	size_t chunk_len = bulk_chunk_len();
+
+	while (atomic_get(&transfer->in_flight) < CONFIG_APP_BT_BULK_IN_FLIGHT) {
+		if (transfer->staged_len == 0) {
+			if (transfer->exhausted) {
+				break;
+			}
+			size_t len = chunk_len - 1;
+			int err = transfer->read(transfer->buf + 1, &len);
+			if (err < 0) {
+				LOG_ERR("Failed to get transfer portion (err %d)", err);
+				transfer->exhausted = true;
+				break;
+			}
+			transfer->exhausted = err == 1;
+			if (len == 0) {
+				continue;
+			}
+			transfer->buf[0] = transfer->piece;
+			transfer->piece++;
+			transfer->staged_len = len + 1;
+		}
+
+		atomic_inc(&transfer->in_flight);
+		int err = bluetooth_send_buf_cb(
+		    transfer->buf, transfer->staged_len, bulk_transfer_callback,
+		    (void *)(uintptr_t)atomic_get(&transfer->generation));
+		if (err != 0) {
+			atomic_dec(&transfer->in_flight);
+		}
+		if (err == -ENOMEM || err == -ENOBUFS) {
+			// Out of TX buffers, a completion will resubmit the work
+			if (atomic_get(&transfer->in_flight) == 0) {
+				k_work_reschedule(&transfer->work, K_MSEC(BULK_TRANSFER_RETRY_MS));
+			}
+			return;
+		} else if (err != 0) {
+			LOG_ERR("Bulk transfer aborted (err %d)", err);
+			transfer->active = false;
+			bulk_transfer_set_fast_link(false);
+			k_work_reschedule(&conn_idle_work, K_MSEC(CONN_IDLE_DELAY_MS));
+			return;
+		}
+		transfer->bytes += transfer->staged_len;
+		transfer->staged_len = 0;
+	}
+
+	if (transfer->exhausted && transfer->staged_len == 0 &&
+	    atomic_get(&transfer->in_flight) == 0) {
+		finish_bulk_transfer(transfer);
+	}
+}
+
+POWER_STATS_HANDLER_DEFINE(POWER_STATS_TRANSFER, bulk_transfer)
+
+static void start_bulk_transfer(bulk_transfer_begin_t begin, bulk_transfer_read_t read,
+				const uint8_t *done_marker, size_t done_marker_len) {
+	k_work_cancel_delayable(&transfer_work.work);
+	transfer_work.piece = 0;
+	transfer_work.begin = begin;
+	transfer_work.read = read;
+	transfer_work.done_marker = done_marker;
+	transfer_work.done_marker_len = done_marker_len;
+	transfer_work.exhausted = false;
+	transfer_work.staged_len = 0;
+	transfer_work.bytes = 0;
+	transfer_work.start_ts = k_uptime_get();
+	atomic_inc(&transfer_work.generation);
+	atomic_set(&transfer_work.in_flight, 0);
+	transfer_work.active = true;
+	k_work_cancel_delayable(&conn_idle_work);
+	conn_policy_set(CONN_MODE_FAST);
+	bulk_transfer_set_fast_link(true);
+	k_work_reschedule(&transfer_work.work, K_NO_WAIT);
+}
+
+static void bulk_transfer_callback(struct bt_conn *, void *user_data) {
+	if ((atomic_val_t)(uintptr_t)user_data != atomic_get(&transfer_work.generation)) {
 		return;
 	}
-	bluetooth_send_buf(telemetry_buf, len + 1, transfer_telemetry_callback);
+	// Never below zero, even if a restart raced with this completion
+	atomic_val_t in_flight;
+	do {
+		in_flight = atomic_get(&transfer_work.in_flight);
+		if (in_flight <= 0) {
+			break;
+		}
+	} while (!atomic_cas(&transfer_work.in_flight, in_flight, in_flight - 1));
+	k_work_reschedule(&transfer_work.work, K_NO_WAIT);
 }
 
-static struct telemetry_transfer_work telemetry_work;
+static void bulk_transfer_abort(void) {
+	// Notifications still queued are dropped with the link, their completions
+	// belong to the old generation
+	transfer_work.active = false;
+	atomic_inc(&transfer_work.generation);
+	atomic_set(&transfer_work.in_flight, 0);
+}
 
-static void start_telemetry_transfer(void) {
-	k_work_init(&telemetry_work.work, &transfer_telemetry);
-	telemetry_work.piece = 0;
+static void telemetry_transfer_begin(void) {
 	// Reset internal pointer
 	(void)telemetry_get_portion(NULL, NULL);
-	k_work_submit(&telemetry_work.work);
 }
 
-static void transfer_telemetry_callback(struct bt_conn *, void *) {
-	k_work_init(&telemetry_work.work, &transfer_telemetry);
-	k_work_submit(&telemetry_work.work);
+static void start_telemetry_transfer(void) {
+	start_bulk_transfer(telemetry_transfer_begin, telemetry_get_portion, TRANSFER_DONE_MARKER,
+			    sizeof(TRANSFER_DONE_MARKER));
+}
+
+static void telemetry_sync_begin(void) {
+	(void)telemetry_get_sync_portion(NULL, NULL);
+}
+
+static void start_telemetry_sync(void) {
+	start_bulk_transfer(telemetry_sync_begin, telemetry_get_sync_portion, SYNC_DONE_MARKER,
+			    sizeof(SYNC_DONE_MARKER));
+}
+
+#ifdef CONFIG_APP_TRACE_RECORDER
+static size_t trace_dump_offset;
+
+static int trace_get_portion(uint8_t *buf, size_t *len) {
+	int rc = trace_recorder_read(trace_dump_offset, buf, *len);
+	if (rc < 0) {
+		return rc;
+	}
+	trace_dump_offset += rc;
+	*len = rc;
+	return rc == 0 ? 1 : 0;
+}
+
+static void start_trace_transfer(void) {
+	trace_dump_offset = 0;
+	start_bulk_transfer(NULL, trace_get_portion, RECORD_DONE_MARKER,
+			    sizeof(RECORD_DONE_MARKER));
 }
+#endif
 
 void bluetooth_support_notify_state(enum posture_state state) {
 	uint8_t send_buf[] = {STATE_MARKER, (uint8_t)state};
 	bluetooth_send_buf(send_buf, sizeof send_buf, NULL);
 }
 
+/* Command handlers, see app/command_protocol.h for the wire format. They run
+ * in BT RX context, anything slow has to be deferred to a work item. */
+
+static bool settings_changed;
+
+static enum cmd_status cmd_get_state(const uint8_t *, uint8_t, struct cmd_response *rsp) {
+	rsp->payload[0] = posture_detection_get_state();
+	rsp->len = 1;
+	return CMD_STATUS_OK;
+}
+
+static enum cmd_status cmd_get_settings(const uint8_t *, uint8_t, struct cmd_response *rsp) {
+	struct posture_settings settings = posture_detection_get_settings();
+	memcpy(rsp->payload, &settings, sizeof(settings));
+	rsp->len = sizeof(settings);
+	return CMD_STATUS_OK;
+}
+
+static enum cmd_status cmd_set_timeout(const uint8_t *payload, uint8_t len,
+				       struct cmd_response *rsp) {
+	LOG_INF("Timeout setting received %d", payload[0]);
+	posture_detection_set_timeout(payload[0]);
+	settings_changed = true;
+	return cmd_get_settings(payload, len, rsp);
+}
+
+static enum cmd_status cmd_set_enabled(const uint8_t *payload, uint8_t len,
+				       struct cmd_response *rsp) {
+	if (payload[0] > 1) {
+		return CMD_STATUS_BAD_VALUE;
+	}
+	LOG_INF("Working setting received %d", payload[0]);
+	posture_detection_set_enabled(payload[0]);
+	settings_changed = true;
+	return cmd_get_settings(payload, len, rsp);
+}
+
+static enum cmd_status cmd_set_range(const uint8_t *payload, uint8_t len,
+				     struct cmd_response *rsp) {
+	LOG_INF("Range setting received %d", payload[0]);
+	posture_detection_set_working_range(payload[0]);
+	settings_changed = true;
+	return cmd_get_settings(payload, len, rsp);
+}
+
+static enum cmd_status cmd_calibrate(const uint8_t *payload, uint8_t len,
+				     struct cmd_response *rsp) {
+	LOG_INF("Calibration requested");
+	posture_detection_do_calibration();
+	settings_changed = true;
+	return cmd_get_settings(payload, len, rsp);
+}
+
+static enum cmd_status cmd_get_link(const uint8_t *, uint8_t, struct cmd_response *rsp) {
+	k_mutex_lock(&bt_conn_mutex, K_FOREVER);
+	if (bt_conn != NULL) {
+		conn_policy_account();
+	}
+	sys_put_le32(conn_policy.time_ms[CONN_MODE_IDLE] / MSEC_PER_SEC, rsp->payload);
+	sys_put_le32(conn_policy.time_ms[CONN_MODE_FAST] / MSEC_PER_SEC, rsp->payload + 4);
+	sys_put_le16(conn_policy.interval, rsp->payload + 8);
+	sys_put_le16(conn_policy.latency, rsp->payload + 10);
+	k_mutex_unlock(&bt_conn_mutex);
+	rsp->len = 12;
+	return CMD_STATUS_OK;
+}
+
+#ifdef CONFIG_APP_POWER_STATS
+static enum cmd_status cmd_get_power_stats(const uint8_t *payload, uint8_t,
+					   struct cmd_response *rsp) {
+	struct power_stats_entry entry;
+	if (power_stats_get(payload[0], &entry) != 0) {
+		return CMD_STATUS_BAD_VALUE;
+	}
+	rsp->payload[0] = payload[0];
+	sys_put_le32(entry.count, rsp->payload + 1);
+	sys_put_le32(entry.time_us, rsp->payload + 5);
+	sys_put_le32(k_uptime_get_32(), rsp->payload + 9);
+	rsp->len = 13;
+	return CMD_STATUS_OK;
+}
+#endif
+
+#ifdef CONFIG_APP_LATENCY_STATS
+/* Histograms don't fit a reply, the host pages through them three buckets
+ * at a time until fewer come back. */
+static enum cmd_status cmd_get_latency(const uint8_t *payload, uint8_t,
+				       struct cmd_response *rsp) {
+	uint32_t counts[3];
+	int n = latency_stats_get(payload[0], payload[1], counts, ARRAY_SIZE(counts));
+	if (n < 0) {
+		return CMD_STATUS_BAD_VALUE;
+	}
+	rsp->payload[0] = payload[0];
+	rsp->payload[1] = payload[1];
+	for (int i = 0; i < n; i++) {
+		sys_put_le32(counts[i], rsp->payload + 2 + 4 * i);
+	}
+	rsp->len = 2 + 4 * n;
+	return CMD_STATUS_OK;
+}
+#endif
+
+/* Counters since boot, for spotting lost records in the field */
+static enum cmd_status cmd_get_queue_stats(const uint8_t *, uint8_t, struct cmd_response *rsp) {
+	struct telemetry_storage_stats telemetry;
+	struct posture_queue_stats posture;
+	telemetry_storage_get_stats(&telemetry);
+	posture_detection_get_queue_stats(&posture);
+	sys_put_le32(telemetry.dropped, rsp->payload);
+	sys_put_le32(telemetry.queued_max, rsp->payload + 4);
+	sys_put_le32(posture.coalesced, rsp->payload + 8);
+	sys_put_le32(posture.backlog_max, rsp->payload + 12);
+	rsp->len = 16;
+	return CMD_STATUS_OK;
+}
+
+static enum cmd_status cmd_telemetry_dump(const uint8_t *, uint8_t, struct cmd_response *) {
+	if (transfer_work.active) {
+		return CMD_STATUS_BUSY;
+	}
+	start_telemetry_transfer();
+	return CMD_STATUS_OK;
+}
+
+static enum cmd_status cmd_telemetry_sync(const uint8_t *, uint8_t, struct cmd_response *) {
+	if (transfer_work.active) {
+		return CMD_STATUS_BUSY;
+	}
+	start_telemetry_sync();
+	return CMD_STATUS_OK;
+}
+
+static enum cmd_status cmd_telemetry_ack(const uint8_t *payload, uint8_t,
+					 struct cmd_response *rsp) {
+	uint32_t seq = sys_get_le32(payload);
+	int err = telemetry_storage_ack(seq);
+	LOG_INF("Telemetry ack %u (err %d)", seq, err);
+	sys_put_le32(telemetry_storage_get_cursor(), rsp->payload);
+	rsp->len = sizeof(uint32_t);
+	if (err == -EINVAL) {
+		return CMD_STATUS_BAD_VALUE;
+	}
+	return err == 0 ? CMD_STATUS_OK : CMD_STATUS_FAILED;
+}
+
+#ifdef CONFIG_APP_TRACE_RECORDER
+static enum cmd_status cmd_record_start(const uint8_t *, uint8_t, struct cmd_response *rsp) {
+	rsp->len = 1;
+	// A new recording would overwrite the trace being dumped
+	if (transfer_work.active && transfer_work.read == trace_get_portion) {
+		rsp->payload[0] = false;
+		return CMD_STATUS_BUSY;
+	}
+	int err = trace_recorder_start();
+	LOG_INF("Trace recording start (err %d)", err);
+	rsp->payload[0] = err == 0;
+	if (err == -EBUSY) {
+		return CMD_STATUS_BUSY;
+	}
+	return err == 0 ? CMD_STATUS_OK : CMD_STATUS_FAILED;
+}
+
+static enum cmd_status cmd_record_stop(const uint8_t *, uint8_t, struct cmd_response *rsp) {
+	LOG_INF("Trace recording stop");
+	trace_recorder_stop();
+	rsp->payload[0] = false;
+	rsp->len = 1;
+	return CMD_STATUS_OK;
+}
+
+static enum cmd_status cmd_record_dump(const uint8_t *, uint8_t, struct cmd_response *) {
+	// The trace can't be read while recording, an empty dump would look valid
+	if (transfer_work.active || trace_recorder_is_recording()) {
+		return CMD_STATUS_BUSY;
+	}
+	LOG_INF("Trace dump requested");
+	start_trace_transfer();
+	return CMD_STATUS_OK;
+}
+#endif
+
+static const struct cmd_def commands[CMD_OPCODE_COUNT] = {
+    [CMD_GET_STATE] = {cmd_get_state, 0, 0},
+    [CMD_GET_SETTINGS] = {cmd_get_settings, 0, 0},
+    [CMD_SET_TIMEOUT] = {cmd_set_timeout, 1, 1},
+    [CMD_SET_ENABLED] = {cmd_set_enabled, 1, 1},
+    [CMD_SET_RANGE] = {cmd_set_range, 1, 1},
+    [CMD_CALIBRATE] = {cmd_calibrate, 0, 0},
+    [CMD_GET_LINK] = {cmd_get_link, 0, 0},
+#ifdef CONFIG_APP_POWER_STATS
+    [CMD_GET_POWER_STATS] = {cmd_get_power_stats, 1, 1},
+#endif
+#ifdef CONFIG_APP_LATENCY_STATS
+    [CMD_GET_LATENCY] = {cmd_get_latency, 2, 2},
+#endif
+    [CMD_GET_QUEUE_STATS] = {cmd_get_queue_stats, 0, 0},
+    [CMD_TELEMETRY_DUMP] = {cmd_telemetry_dump, 0, 0},
+    [CMD_TELEMETRY_SYNC] = {cmd_telemetry_sync, 0, 0},
+    [CMD_TELEMETRY_ACK] = {cmd_telemetry_ack, 4, 4},
+#ifdef CONFIG_APP_TRACE_RECORDER
+    [CMD_RECORD_START] = {cmd_record_start, 0, 0},
+    [CMD_RECORD_STOP] = {cmd_record_stop, 0, 0},
+    [CMD_RECORD_DUMP] = {cmd_record_dump, 0, 0},
+#endif
+};
+
+static void command_reply(const uint8_t *buf, size_t len) {
+	bluetooth_send_buf(buf, len, NULL);
+}
+
 static void bt_data_received(struct bt_conn *conn, const void *data, uint16_t len, void *) {
 	if (conn != bt_conn) {
 		LOG_WRN("Received data from unknown connection");
@@ -368,24 +889,17 @@ static void bt_data_received(struct bt_conn *conn, const void *data, uint16_t le
 		LOG_WRN("Security level too low, ignoring data");
 		return;
 	}
-	LOG_DBG("Received data: %.*s", len, (char *)data);
-	if (len > sizeof(SETTINGS_MARKER) &&
-	    memcmp(data, SETTINGS_MARKER, sizeof(SETTINGS_MARKER)) == 0) {
-		LOG_INF("Settings received");
-		parse_setting_payload((const uint8_t *)data + sizeof(SETTINGS_MARKER),
-				      len - sizeof(SETTINGS_MARKER));
-	} else if (len == sizeof(TELEMETRY_MARKER) &&
-		   memcmp(data, TELEMETRY_MARKER, sizeof(TELEMETRY_MARKER)) == 0) {
-		LOG_INF("Telemetry marker received");
-		start_telemetry_transfer();
-	} else if (len == sizeof(STATE_REQ_MARKER) && memcmp(data, STATE_REQ_MARKER, sizeof(STATE_REQ_MARKER)) == 0) {
-		LOG_INF("Sending state");
-		bluetooth_support_notify_state(posture_detection_get_state());
-	} else if (len == sizeof(SETTINGS_REQ_MARKER) && memcmp(data, SETTINGS_REQ_MARKER, sizeof(SETTINGS_REQ_MARKER)) == 0) {
-		LOG_INF("Sending sett");
-		bluetooth_support_notify_settings();
-	} else {
-		LOG_INF("Unknown data received");
+	LOG_HEXDUMP_DBG(data, len, "Received data");
+	power_stats_count(POWER_STATS_BT_RX);
+
+	settings_changed = false;
+	int handled = command_protocol_process(commands, ARRAY_SIZE(commands), data, len,
+					       command_reply);
+	if (handled < 0) {
+		LOG_WRN("Malformed command frame");
+	}
+	if (settings_changed) {
+		posture_detection_save_settings();
 	}
 }
 
@@ -414,16 +928,26 @@ static int bluetooth_init(void) {
 	bt_conn_auth_cb_register(&auth_cbs);
 	bt_conn_auth_info_cb_register(&ble_auth_info_cb_display);
 	bt_nus_cb_register(&nus_callbacks, NULL);
-	k_work_submit(&update_advertisement_work);
+	k_work_init_delayable(&transfer_work.work, POWER_STATS_HANDLER(bulk_transfer));
+	bluetooth_support_wake_advertising();
 	return 0;
 }
 SYS_INIT(bluetooth_init, APPLICATION, 1);
 
 void bluetooth_support_notify_posture(void) {
+	if (bt_conn == NULL) {
+		// Give the phone a quick chance to pick the alert up
+		bluetooth_support_wake_advertising();
+		return;
+	}
 	bluetooth_send_buf(POSTURE_NOTIF, sizeof(POSTURE_NOTIF), NULL);
 }
 
 void bluetooth_support_notify_movement(void) {
+	if (bt_conn == NULL) {
+		bluetooth_support_wake_advertising();
+		return;
+	}
 	bluetooth_send_buf(MOVEMENT_NOTIF, sizeof(MOVEMENT_NOTIF), NULL);
 }
 
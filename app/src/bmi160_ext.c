@@ -0,0 +1,211 @@
+#include "app/bmi160_ext.h"
+
+#include <zephyr/drivers/i2c.h>
+#include <zephyr/drivers/sensor.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+
+LOG_MODULE_REGISTER(bmi160_ext, LOG_LEVEL_INF);
+
+#define BMI160_NODE DT_COMPAT_GET_ANY_STATUS_OKAY(bosch_bmi160)
+
+#define BMI160_REG_FIFO_LENGTH 0x22u
+#define BMI160_FIFO_LENGTH_MASK 0x07FFu
+#define BMI160_REG_FIFO_DATA 0x24u
+#define BMI160_REG_ACC_CONF 0x40u
+#define BMI160_REG_ACC_RANGE 0x41u
+#define BMI160_REG_GYR_CONF 0x42u
+#define BMI160_REG_GYR_RANGE 0x43u
+#define BMI160_CONF_ODR_MASK 0x0Fu
+#define BMI160_GYR_ODR_MIN 0x06u
+#define BMI160_REG_FIFO_CONFIG_1 0x47u
+#define BMI160_FIFO_GYR_EN BIT(7)
+#define BMI160_FIFO_ACC_EN BIT(6)
+#define BMI160_REG_CMD 0x7Eu
+#define BMI160_CMD_GYR_SUSPEND 0x14u
+#define BMI160_CMD_GYR_NORMAL 0x15u
+#define BMI160_CMD_FIFO_FLUSH 0xB0u
+
+#define BMI160_FIFO_CAPACITY 1024u
+#define BMI160_AXES_SIZE 6u
+#define BMI160_FIFO_READ_MAX_FRAMES 16u
+
+static const struct i2c_dt_spec bmi160_i2c = I2C_DT_SPEC_GET(BMI160_NODE);
+
+static struct {
+  uint32_t frame_period_us;
+  int32_t full_scale_mm_s2;
+  int32_t full_scale_mdeg_s;
+  size_t frame_size;
+} fifo_state;
+
+// Headerless frames, gyro axes come first when enabled
+static uint8_t fifo_buf[BMI160_FIFO_READ_MAX_FRAMES * 2 * BMI160_AXES_SIZE];
+
+static int range_to_g(uint8_t range) {
+  switch (range) {
+  case 0x03:
+    return 2;
+  case 0x05:
+    return 4;
+  case 0x08:
+    return 8;
+  case 0x0C:
+    return 16;
+  default:
+    return -EINVAL;
+  }
+}
+
+static uint32_t odr_to_period_us(uint8_t odr) {
+  // ODR = 100 Hz / 2^(8 - odr)
+  if (odr <= 8) {
+    return 10000u << (8 - odr);
+  }
+  return 10000u >> (odr - 8);
+}
+
+static inline int32_t scale_raw(const uint8_t *raw, int32_t full_scale) {
+  int64_t value = (int16_t)sys_get_le16(raw);
+  return (int32_t)(value * full_scale / 32768);
+}
+
+static int configure_gyro(uint8_t acc_odr) {
+  uint8_t gyr_conf;
+  uint8_t gyr_range;
+  if (i2c_reg_read_byte_dt(&bmi160_i2c, BMI160_REG_GYR_CONF, &gyr_conf) < 0 ||
+      i2c_reg_read_byte_dt(&bmi160_i2c, BMI160_REG_GYR_RANGE, &gyr_range) < 0) {
+    LOG_ERR("Failed to read gyroscope configuration");
+    return -EIO;
+  }
+  // 2000 dps at range 0, halved with every step
+  fifo_state.full_scale_mdeg_s = (2000 >> (gyr_range & 0x07)) * 1000;
+
+  // Headerless frames require both sensors to run at the same ODR
+  if ((gyr_conf & BMI160_CONF_ODR_MASK) == acc_odr) {
+    return 0;
+  }
+  if (acc_odr < BMI160_GYR_ODR_MIN) {
+    LOG_ERR("Accelerometer ODR too low for the gyroscope");
+    return -EINVAL;
+  }
+  gyr_conf = (gyr_conf & ~BMI160_CONF_ODR_MASK) | acc_odr;
+  if (i2c_reg_write_byte_dt(&bmi160_i2c, BMI160_REG_GYR_CONF, gyr_conf) < 0) {
+    LOG_ERR("Failed to set gyroscope ODR");
+    return -EIO;
+  }
+  return 0;
+}
+
+int bmi160_fifo_start(bool with_gyro) {
+  if (!device_is_ready(bmi160_i2c.bus)) {
+    LOG_ERR("I2C bus not ready");
+    return -ENODEV;
+  }
+
+  uint8_t acc_conf;
+  uint8_t acc_range;
+  if (i2c_reg_read_byte_dt(&bmi160_i2c, BMI160_REG_ACC_CONF, &acc_conf) < 0 ||
+      i2c_reg_read_byte_dt(&bmi160_i2c, BMI160_REG_ACC_RANGE, &acc_range) < 0) {
+    LOG_ERR("Failed to read accelerometer configuration");
+    return -EIO;
+  }
+
+  int range_g = range_to_g(acc_range);
+  uint8_t odr = acc_conf & BMI160_CONF_ODR_MASK;
+  if (range_g < 0 || odr == 0) {
+    LOG_ERR("Unexpected accelerometer configuration %02x %02x", acc_conf,
+            acc_range);
+    return -EINVAL;
+  }
+  fifo_state.full_scale_mm_s2 = range_g * (SENSOR_G / 1000);
+  fifo_state.frame_period_us = odr_to_period_us(odr);
+  fifo_state.frame_size = BMI160_AXES_SIZE;
+  fifo_state.full_scale_mdeg_s = 0;
+
+  uint8_t fifo_config = BMI160_FIFO_ACC_EN;
+  if (with_gyro) {
+    int rc = configure_gyro(odr);
+    if (rc < 0) {
+      return rc;
+    }
+    fifo_config |= BMI160_FIFO_GYR_EN;
+    fifo_state.frame_size += BMI160_AXES_SIZE;
+  }
+
+  if (i2c_reg_write_byte_dt(&bmi160_i2c, BMI160_REG_FIFO_CONFIG_1,
+                            fifo_config) < 0 ||
+      i2c_reg_write_byte_dt(&bmi160_i2c, BMI160_REG_CMD,
+                            BMI160_CMD_FIFO_FLUSH) < 0) {
+    LOG_ERR("Failed to enable FIFO");
+    return -EIO;
+  }
+  LOG_INF("FIFO enabled, frame period %u us, range %d g, gyro %d",
+          fifo_state.frame_period_us, range_g, with_gyro);
+  return 0;
+}
+
+int bmi160_fifo_stop(void) {
+  if (i2c_reg_write_byte_dt(&bmi160_i2c, BMI160_REG_FIFO_CONFIG_1, 0) < 0) {
+    LOG_ERR("Failed to disable FIFO");
+    return -EIO;
+  }
+  return 0;
+}
+
+int bmi160_fifo_read(struct bmi160_fifo_sample *samples, size_t max_samples) {
+  uint8_t len_buf[2];
+  if (i2c_burst_read_dt(&bmi160_i2c, BMI160_REG_FIFO_LENGTH, len_buf,
+                        sizeof(len_buf)) < 0) {
+    LOG_ERR("Failed to read FIFO length");
+    return -EIO;
+  }
+  size_t fifo_len = sys_get_le16(len_buf) & BMI160_FIFO_LENGTH_MASK;
+  if (fifo_len + fifo_state.frame_size > BMI160_FIFO_CAPACITY) {
+    LOG_WRN("FIFO overrun, oldest samples lost");
+  }
+
+  size_t frames = MIN(fifo_len / fifo_state.frame_size,
+                      MIN(max_samples, BMI160_FIFO_READ_MAX_FRAMES));
+  if (frames == 0) {
+    return 0;
+  }
+  if (i2c_burst_read_dt(&bmi160_i2c, BMI160_REG_FIFO_DATA, fifo_buf,
+                        frames * fifo_state.frame_size) < 0) {
+    LOG_ERR("Failed to read FIFO data");
+    return -EIO;
+  }
+
+  for (size_t i = 0; i < frames; i++) {
+    const uint8_t *frame = &fifo_buf[i * fifo_state.frame_size];
+    struct bmi160_fifo_sample *sample = &samples[i];
+    *sample = (struct bmi160_fifo_sample){0};
+    if (fifo_state.frame_size > BMI160_AXES_SIZE) {
+      sample->gyro_x = scale_raw(&frame[0], fifo_state.full_scale_mdeg_s);
+      sample->gyro_y = scale_raw(&frame[2], fifo_state.full_scale_mdeg_s);
+      sample->gyro_z = scale_raw(&frame[4], fifo_state.full_scale_mdeg_s);
+      frame += BMI160_AXES_SIZE;
+    }
+    sample->x = (int16_t)scale_raw(&frame[0], fifo_state.full_scale_mm_s2);
+    sample->y = (int16_t)scale_raw(&frame[2], fifo_state.full_scale_mm_s2);
+    sample->z = (int16_t)scale_raw(&frame[4], fifo_state.full_scale_mm_s2);
+  }
+  return (int)frames;
+}
+
+uint32_t bmi160_fifo_frame_period_us(void) {
+  return fifo_state.frame_period_us;
+}
+
+int bmi160_gyro_set_power(bool enabled) {
+  if (!device_is_ready(bmi160_i2c.bus)) {
+    return -ENODEV;
+  }
+  uint8_t cmd = enabled ? BMI160_CMD_GYR_NORMAL : BMI160_CMD_GYR_SUSPEND;
+  if (i2c_reg_write_byte_dt(&bmi160_i2c, BMI160_REG_CMD, cmd) < 0) {
+    LOG_ERR("Failed to change gyroscope power mode");
+    return -EIO;
+  }
+  LOG_INF("Gyroscope %s", enabled ? "enabled" : "suspended");
+  return 0;
+}
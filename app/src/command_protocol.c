@@ -0,0 +1,51 @@
+#include "app/command_protocol.h"
+
+#include <errno.h>
+#include <string.h>
+
+#define CMD_HEADER_LEN 2
+
+static void send_reply(cmd_reply_t reply, uint8_t opcode, enum cmd_status status,
+		       const struct cmd_response *rsp) {
+	uint8_t buf[CMD_HEADER_LEN + CMD_RESPONSE_PAYLOAD_MAX];
+	size_t payload_len = status == CMD_STATUS_OK ? rsp->len : 0;
+
+	buf[0] = opcode | CMD_RESPONSE_FLAG;
+	buf[1] = status;
+	memcpy(buf + CMD_HEADER_LEN, rsp->payload, payload_len);
+	reply(buf, CMD_HEADER_LEN + payload_len);
+}
+
+int command_protocol_process(const struct cmd_def *table, size_t table_len, const uint8_t *data,
+			     size_t len, cmd_reply_t reply) {
+	int handled = 0;
+	size_t pos = 0;
+
+	while (pos < len) {
+		struct cmd_response rsp = {0};
+		uint8_t opcode = data[pos];
+		if (len - pos < CMD_HEADER_LEN || len - pos - CMD_HEADER_LEN < data[pos + 1]) {
+			send_reply(reply, opcode, CMD_STATUS_MALFORMED, &rsp);
+			return -EBADMSG;
+		}
+		uint8_t payload_len = data[pos + 1];
+		const uint8_t *payload = data + pos + CMD_HEADER_LEN;
+		pos += CMD_HEADER_LEN + payload_len;
+
+		enum cmd_status status;
+		const struct cmd_def *def = opcode < table_len ? &table[opcode] : NULL;
+		if (def == NULL || def->handler == NULL) {
+			status = CMD_STATUS_UNKNOWN_OPCODE;
+		} else if (payload_len < def->min_len || payload_len > def->max_len) {
+			status = CMD_STATUS_BAD_LENGTH;
+		} else {
+			status = def->handler(payload, payload_len, &rsp);
+			if (status == CMD_STATUS_OK && rsp.len > CMD_RESPONSE_PAYLOAD_MAX) {
+				status = CMD_STATUS_FAILED;
+			}
+		}
+		send_reply(reply, opcode, status, &rsp);
+		handled++;
+	}
+	return handled;
+}
@@ -0,0 +1,106 @@
+#include "app/deadline_scheduler.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/spinlock.h>
+
+static void deadline_run(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(deadline_work, deadline_run);
+
+static struct k_spinlock lock;
+// Armed deadlines, unordered. There are only a handful of them.
+static sys_slist_t armed_list;
+static uint32_t current_pass;
+
+// Held while handlers run, lets deadline_cancel_sync() wait for them
+static K_MUTEX_DEFINE(run_lock);
+
+/* Called with lock held. */
+static void rearm_timer(void) {
+	int64_t wake = INT64_MAX;
+	struct deadline *deadline;
+	SYS_SLIST_FOR_EACH_CONTAINER(&armed_list, deadline, node) {
+		wake = MIN(wake, deadline->at);
+	}
+	if (wake == INT64_MAX) {
+		(void)k_work_cancel_delayable(&deadline_work);
+	} else {
+		(void)k_work_reschedule(&deadline_work, K_TIMEOUT_ABS_TICKS(wake));
+	}
+}
+
+/* Called with lock held. */
+static bool disarm(struct deadline *deadline) {
+	if (!deadline->armed) {
+		return false;
+	}
+	(void)sys_slist_find_and_remove(&armed_list, &deadline->node);
+	deadline->armed = false;
+	return true;
+}
+
+static void deadline_run(struct k_work *work) {
+	ARG_UNUSED(work);
+
+	k_mutex_lock(&run_lock, K_FOREVER);
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	int64_t now = k_uptime_ticks();
+	// Deadlines re-armed by a handler wait for the next pass, even if due
+	uint32_t pass = ++current_pass;
+	for (;;) {
+		struct deadline *due = NULL;
+		struct deadline *deadline;
+		SYS_SLIST_FOR_EACH_CONTAINER(&armed_list, deadline, node) {
+			if (deadline->at <= now && deadline->pass != pass) {
+				due = deadline;
+				break;
+			}
+		}
+		if (due == NULL) {
+			break;
+		}
+		(void)disarm(due);
+		k_spin_unlock(&lock, key);
+		due->handler(due);
+		key = k_spin_lock(&lock);
+	}
+	rearm_timer();
+	k_spin_unlock(&lock, key);
+	k_mutex_unlock(&run_lock);
+}
+
+void deadline_arm(struct deadline *deadline, uint32_t delay_ms) {
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	(void)disarm(deadline);
+	deadline->at = k_uptime_ticks() + k_ms_to_ticks_ceil64(delay_ms);
+	deadline->pass = current_pass;
+	deadline->armed = true;
+	sys_slist_append(&armed_list, &deadline->node);
+	rearm_timer();
+	k_spin_unlock(&lock, key);
+}
+
+bool deadline_is_armed(struct deadline *deadline) {
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	bool armed = deadline->armed;
+	k_spin_unlock(&lock, key);
+	return armed;
+}
+
+bool deadline_cancel(struct deadline *deadline) {
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	bool was_armed = disarm(deadline);
+	if (was_armed) {
+		rearm_timer();
+	}
+	k_spin_unlock(&lock, key);
+	return was_armed;
+}
+
+bool deadline_cancel_sync(struct deadline *deadline) {
+	// Recursive for the workqueue thread, so handlers may call this too
+	k_mutex_lock(&run_lock, K_FOREVER);
+	bool was_armed = deadline_cancel(deadline);
+	k_mutex_unlock(&run_lock);
+	return was_armed;
+}
@@ -0,0 +1,82 @@
+#include "app/fixed_math.h"
+
+#include <stdlib.h>
+
+/* No Zephyr headers here, tests/host builds this file for the host */
+
+#define DEG_180_Q16 (180 << 16)
+#define DEG_90_Q16 (90 << 16)
+
+// atan(2^-i) in degrees, Q16.16
+static const int32_t cordic_atan_q16[] = {
+    2949120, 1740967, 919879, 466945, 234379, 117304, 58666, 29335,
+    14668,   7334,    3667,   1833,   917,    458,    229,    115,
+};
+
+// Keeps the CORDIC vector (with its 1.647 gain) inside int32
+#define CORDIC_INPUT_MAX_BITS 29
+
+int32_t fixed_atan2_q16(int32_t y, int32_t x) {
+  if (x == 0 && y == 0) {
+    return 0;
+  }
+  if (x == 0) {
+    return y > 0 ? DEG_90_Q16 : -DEG_90_Q16;
+  }
+
+  int32_t angle = 0;
+  // Rotate into the right half-plane, CORDIC vectoring converges in +-90 deg
+  if (x < 0) {
+    angle = y >= 0 ? DEG_180_Q16 : -DEG_180_Q16;
+    x = -x;
+    y = -y;
+  }
+
+  // Scale up small inputs so the last iterations still carry precision
+  uint32_t max_abs = (uint32_t)(x > abs(y) ? x : abs(y));
+  while (max_abs < (1u << (CORDIC_INPUT_MAX_BITS - 1))) {
+    max_abs <<= 1;
+    x *= 2;
+    y *= 2;
+  }
+  while (max_abs >= (1u << CORDIC_INPUT_MAX_BITS)) {
+    max_abs >>= 1;
+    x /= 2;
+    y /= 2;
+  }
+
+  for (unsigned i = 0; i < sizeof(cordic_atan_q16) / sizeof(cordic_atan_q16[0]);
+       i++) {
+    int32_t x_shift = x >> i;
+    int32_t y_shift = y >> i;
+    if (y > 0) {
+      x += y_shift;
+      y -= x_shift;
+      angle += cordic_atan_q16[i];
+    } else {
+      x -= y_shift;
+      y += x_shift;
+      angle -= cordic_atan_q16[i];
+    }
+  }
+  return angle;
+}
+
+uint16_t fixed_isqrt(uint32_t value) {
+  uint32_t result = 0;
+  uint32_t bit = 1u << 30;
+
+  while (bit > value) {
+    bit >>= 2;
+  }
+  while (bit != 0) {
+    if (value >= result + bit) {
+      value -= result + bit;
+      result = (result >> 1) + bit;
+    } else {
+      result >>= 1;
+    }
+    bit >>= 2;
+  }
+  return (uint16_t)result;
+}
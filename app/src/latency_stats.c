@@ -0,0 +1,69 @@
+#include "app/latency_stats.h"
+
+#include <errno.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/util.h>
+
+// Stages are recorded from the sensor and the posture work handlers
+static atomic_t histograms[LATENCY_STAGE_COUNT][LATENCY_HIST_BUCKETS];
+
+static unsigned bucket_of(uint32_t us) {
+	if (us == 0) {
+		return 0;
+	}
+	return MIN(LOG2(us) + 1, LATENCY_HIST_BUCKETS - 1);
+}
+
+void latency_stats_record(enum latency_stage stage, uint32_t start, uint32_t end) {
+	uint32_t us = k_cyc_to_us_floor32(end - start);
+	atomic_inc(&histograms[stage][bucket_of(us)]);
+}
+
+int latency_stats_get(enum latency_stage stage, unsigned first, uint32_t *counts, unsigned max) {
+	if (stage >= LATENCY_STAGE_COUNT || first >= LATENCY_HIST_BUCKETS) {
+		return -EINVAL;
+	}
+	unsigned n = MIN(max, LATENCY_HIST_BUCKETS - first);
+	for (unsigned i = 0; i < n; i++) {
+		counts[i] = atomic_get(&histograms[stage][first + i]);
+	}
+	return n;
+}
+
+#ifdef CONFIG_SHELL
+static const char *const stage_names[LATENCY_STAGE_COUNT] = {
+    [LATENCY_STAGE_WINDOW] = "window",
+    [LATENCY_STAGE_QUEUE] = "queue",
+    [LATENCY_STAGE_ACTION] = "action",
+    [LATENCY_STAGE_TOTAL] = "total",
+    [LATENCY_STAGE_SENSOR_READ] = "sensor_read",
+    [LATENCY_STAGE_SENSOR_BLOCKED] = "sensor_blocked",
+};
+
+static int cmd_latency_stats(const struct shell *sh, size_t argc, char **argv) {
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++) {
+		uint32_t counts[LATENCY_HIST_BUCKETS];
+		(void)latency_stats_get(stage, 0, counts, ARRAY_SIZE(counts));
+		shell_print(sh, "%s:", stage_names[stage]);
+		for (int b = 0; b < LATENCY_HIST_BUCKETS; b++) {
+			if (counts[b] == 0) {
+				continue;
+			}
+			if (b == LATENCY_HIST_BUCKETS - 1) {
+				shell_print(sh, "  >= %7u us %10u", 1u << (b - 1), counts[b]);
+			} else {
+				shell_print(sh, "  < %8u us %10u", 1u << b, counts[b]);
+			}
+		}
+	}
+	return 0;
+}
+
+SHELL_CMD_REGISTER(latency_stats, NULL, "Posture alert latency histograms", cmd_latency_stats);
+#endif
@@ -12,7 +12,9 @@
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 
+#include "app/posture_detection.h"
 #include "app/sensor_processing.h"
+#include "app/telemetry_storage.h"
 
 #include <app_version.h>
 
@@ -34,23 +36,20 @@ int init_device(const struct device *const dev) {
 }
 
 int main(void) {
-        const struct device *const bmi160 = DEVICE_DT_GET_ANY(bosch_bmi160);
+        const struct device *const accel = DEVICE_DT_GET(DT_ALIAS(accel0));
 
         printk("Zephyr not Example Application %s\n", APP_VERSION_STRING);
 
-        if (init_device(bmi160)) {
+        if (init_device(accel)) {
                 LOG_ERR("Gyro not ready");
                 return 0;
         }
 
         printk("Initialization complete\n");
 
-        sensor_processing_start(bmi160);
-
-        while (1) {
-                k_sleep(K_MSEC(500));
-        } 
+        sensor_processing_start(accel);
 
+        // Everything else runs from deadlines, work items and input callbacks
         return 0;
 }
 static void input_callback(struct input_event *event, void *user_data) {
@@ -59,6 +58,7 @@ static void input_callback(struct input_event *event, void *user_data) {
         if (event->type != INPUT_EV_KEY || event->value != 0) {
                 return;
         }
+        bluetooth_support_wake_advertising();
         if (event->code == INPUT_KEY_POWER) {
 
                 const struct gpio_dt_spec power_button =
@@ -78,6 +78,8 @@ static void input_callback(struct input_event *event, void *user_data) {
                         return;
                 }
                 printf("Power button pressed, shutting down...\n");
+                (void)telemetry_storage_flush();
+                posture_detection_flush_settings();
                 sys_poweroff();
         } else if (event->code == INPUT_KEY_DELETE) {
                 bluetooth_remove_bonded_peer();
@@ -4,15 +4,23 @@
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 
+#include "app/deadline_scheduler.h"
+#include "app/latency_stats.h"
+#include "app/power_stats.h"
 #include "app/telemetry_storage.h"
 #include "app/vibration.h"
 #include "app/bluetooth_support.h"
+#include "app/trace_replay.h"
 #include "zephyr/settings/settings.h"
+#include "zephyr/sys/atomic.h"
+#include "zephyr/sys/spsc_lockfree.h"
 
 LOG_MODULE_REGISTER(posture_detection, LOG_LEVEL_INF);
 
 #define MOVEMENT_THRESHOLD 1000u
 
+#define FUSED_MOVEMENT_THRESHOLD 3000u
+
 #define POSTURE_DETECTION_ANGLE_THRESHOLD 50
 
 #define POSTURE_NO_MOVEMENT_TIMEOUT_S (60u * 30u)
@@ -23,9 +31,13 @@ LOG_MODULE_REGISTER(posture_detection, LOG_LEVEL_INF);
 
 #define SETTINGS_NAME "posture_detection"
 
+/* Settings changes arriving within this window are written in one go */
+#define SETTINGS_SAVE_DELAY_MS 2000
+
+#define POSTURE_QUEUE_LEN 4 /* power of two */
+
 struct posture_work {
 	struct k_work work;
-	struct posture_data data;
 
 	enum posture_state state;
 	int64_t state_start_ts;
@@ -109,9 +121,82 @@ static void update_stats(struct posture_work *posture_work) {
 	}	
 }
 
-static void process_data(struct k_work *work) {
-	struct posture_work *posture_work = CONTAINER_OF(work, struct posture_work, work);
-	struct posture_data data = posture_work->data;
+/* Returns true if a reminder was issued */
+static bool check_movement_reminder(struct posture_work *posture_work) {
+	uint32_t movement_time_diff_s =
+	    (k_uptime_get() - posture_work->movement_notification_ts) / 1000;
+	if (posture_work->state != POSTURE_STATE_MOVEMENTS &&
+	    movement_time_diff_s > POSTURE_NO_MOVEMENT_TIMEOUT_S) {
+		vibration_short_start();
+		bluetooth_support_notify_movement();
+
+		posture_work->telemetry.activeness_notifications++;
+		posture_work->movement_notification_ts = k_uptime_get();
+		return true;
+	}
+	return false;
+}
+
+static void check_telemetry_submit(struct posture_work *posture_work) {
+	bool is_telemetry_timeout_expired =
+	    (k_uptime_get() - posture_work->telemetry_submit_ts) / 1000 >
+	    TELEMETRY_SUBMIT_TIMEOUT_S;
+	if (is_telemetry_timeout_expired) {
+		update_stats(posture_work);
+		posture_work->state_start_ts = k_uptime_get();
+		posture_work->telemetry_submit_ts = k_uptime_get();
+		telemetry_storage_submit(&posture_work->telemetry);
+		posture_work->telemetry = (struct telemetry){0};
+	}
+}
+
+/* Returns true if the bad posture alert was issued */
+static bool check_incorrect_timeout(struct posture_work *posture_work) {
+	bool is_incorrect_timeout_expired =
+	    (k_uptime_get() - posture_work->state_start_ts) / 1000 > settings.detection_time;
+	if (posture_work->state == POSTURE_STATE_INCORRECT && is_incorrect_timeout_expired &&
+	    !posture_work->is_vibrating) {
+		posture_work->is_vibrating = true;
+		bluetooth_support_notify_posture();
+		vibration_start();
+
+		posture_work->telemetry.posture_notifications++;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Updates from sensor_processing travel through an SPSC ring and are
+ * processed in order. When the ring is full the producer folds new updates
+ * into one staged update: angles take the latest value, the movement peak is
+ * kept, so a short spike can't be lost while the workqueue is busy. The
+ * fetch stamp stays that of the oldest merged update. The staged update is
+ * always newer than the ring contents; once the ring runs empty process_data
+ * takes it directly, so it doesn't wait for the next producer call, which may
+ * be long in coming when sampling slows down or parks.
+ */
+SPSC_DEFINE(posture_queue, struct posture_data, POSTURE_QUEUE_LEN);
+
+static struct {
+	struct posture_data data;
+	bool valid;
+} staged_update;
+static struct k_spinlock staged_lock;
+
+static atomic_t updates_coalesced;
+static atomic_t updates_backlog_max;
+
+static void record_alert_latency(const struct posture_data *data, uint32_t detect_cyc) {
+	uint32_t now = latency_stats_now();
+	latency_stats_record(LATENCY_STAGE_ACTION, detect_cyc, now);
+	latency_stats_record(LATENCY_STAGE_TOTAL, data->fetch_cyc, now);
+}
+
+static void process_sample(struct posture_work *posture_work, struct posture_data data) {
+	uint32_t detect_cyc = latency_stats_now();
+	latency_stats_record(LATENCY_STAGE_QUEUE, data.window_cyc, detect_cyc);
+
 	if (posture_work->state_start_ts == 0) {
 		posture_work->state_start_ts = k_uptime_get();
 		posture_work->movement_notification_ts = k_uptime_get();
@@ -119,7 +204,9 @@ static void process_data(struct k_work *work) {
 	}
 
 	enum posture_state wanted_state = POSTURE_STATE_CORRECT;
-	bool is_moving = data.cm_s2_max_accel_diff > MOVEMENT_THRESHOLD;
+	unsigned movement_threshold =
+	    data.angles_fused ? FUSED_MOVEMENT_THRESHOLD : MOVEMENT_THRESHOLD;
+	bool is_moving = data.cm_s2_max_accel_diff > movement_threshold;
 
 	if (is_moving) {
 		wanted_state = POSTURE_STATE_MOVEMENTS;
@@ -135,49 +222,26 @@ static void process_data(struct k_work *work) {
 		calibration_flag = false;
 		settings.x_angle_calibration = (int8_t)data.x_angle;
 		LOG_INF("Calibration done, new offset %d", settings.x_angle_calibration);
+		posture_detection_save_settings();
 	}
 
 	if (!settings.is_notifying && wanted_state != POSTURE_STATE_MOVEMENTS) {
 		wanted_state = POSTURE_STATE_INVALID;
 	}
 
-	uint32_t movement_time_diff_s =
-	    (k_uptime_get() - posture_work->movement_notification_ts) / 1000;
-	if (posture_work->state != POSTURE_STATE_MOVEMENTS &&
-	    movement_time_diff_s > POSTURE_NO_MOVEMENT_TIMEOUT_S) {
-		vibration_short_start();
-		bluetooth_support_notify_movement();
-
-		posture_work->telemetry.activeness_notifications++;
-		posture_work->movement_notification_ts = k_uptime_get();
-	}
-
-	bool is_telemetry_timeout_expired =
-	    (k_uptime_get() - posture_work->telemetry_submit_ts) / 1000 >
-	    TELEMETRY_SUBMIT_TIMEOUT_S;
-	if (is_telemetry_timeout_expired) {
-		update_stats(posture_work);
-		posture_work->state_start_ts = k_uptime_get();
-		posture_work->telemetry_submit_ts = k_uptime_get();
-		telemetry_storage_submit(&posture_work->telemetry);
-		posture_work->telemetry = (struct telemetry){0};
-	}
+	bool alerted = check_movement_reminder(posture_work);
+	check_telemetry_submit(posture_work);
 
 	if (wanted_state == posture_work->state) {
-		bool is_incorrect_timeout_expired =
-		    (k_uptime_get() - posture_work->state_start_ts) / 1000 >
-		    settings.detection_time;
-		if (wanted_state == POSTURE_STATE_INCORRECT && is_incorrect_timeout_expired &&
-		    !posture_work->is_vibrating) {
-			posture_work->is_vibrating = true;
-			bluetooth_support_notify_posture();
-			vibration_start();
-
-			posture_work->telemetry.posture_notifications++;
+		if (check_incorrect_timeout(posture_work) || alerted) {
+			record_alert_latency(&data, detect_cyc);
 		}
 		// Nothing to do
 		return;
 	}
+	if (alerted) {
+		record_alert_latency(&data, detect_cyc);
+	}
 
 	if (posture_work->is_vibrating) {
 		vibration_stop();
@@ -193,18 +257,134 @@ static void process_data(struct k_work *work) {
 	LOG_INF("Posture state changed to %d", posture_work->state);
 	posture_work->state_start_ts = k_uptime_get();
 	bluetooth_support_notify_state(wanted_state);
+	trace_replay_on_state(wanted_state);
+}
+
+static bool take_update(struct posture_data *data) {
+	struct posture_data *queued = spsc_consume(&posture_queue);
+	if (queued != NULL) {
+		*data = *queued;
+		spsc_release(&posture_queue);
+		return true;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&staged_lock);
+	bool valid = staged_update.valid;
+	if (valid) {
+		*data = staged_update.data;
+		staged_update.valid = false;
+	}
+	k_spin_unlock(&staged_lock, key);
+	return valid;
+}
+
+static void process_data(struct k_work *work) {
+	struct posture_work *posture_work = CONTAINER_OF(work, struct posture_work, work);
+	struct posture_data data;
+	while (take_update(&data)) {
+		process_sample(posture_work, data);
+	}
 }
 
+POWER_STATS_HANDLER_DEFINE(POWER_STATS_POSTURE, process_data)
+
 static struct posture_work process_data_work = {
-    .work = Z_WORK_INITIALIZER(process_data),
+    .work = Z_WORK_INITIALIZER(POWER_STATS_HANDLER(process_data)),
 };
-void posture_detection_update(struct posture_data *data) {
-	if (k_work_is_pending(&process_data_work.work)) {
+
+/* Earliest uptime at which one of the timeouts checked in process_data expires.
+ * The checks compare whole seconds with '>', hence the extra second. */
+static int64_t next_deadline_ms(const struct posture_work *posture_work) {
+	int64_t deadline = posture_work->telemetry_submit_ts +
+			   (TELEMETRY_SUBMIT_TIMEOUT_S + 1) * MSEC_PER_SEC;
+	if (posture_work->state != POSTURE_STATE_MOVEMENTS) {
+		deadline = MIN(deadline, posture_work->movement_notification_ts +
+					     (POSTURE_NO_MOVEMENT_TIMEOUT_S + 1) * MSEC_PER_SEC);
+	}
+	if (posture_work->state == POSTURE_STATE_INCORRECT && !posture_work->is_vibrating) {
+		deadline = MIN(deadline, posture_work->state_start_ts +
+					     (settings.detection_time + 1) * MSEC_PER_SEC);
+	}
+	return deadline;
+}
+
+static void schedule_suspended_deadline(void);
+
+/* While sampling is parked no posture_data arrives, so the timeouts are driven
+ * by a deadline instead. The posture state can't change without movement. */
+static void suspended_deadline_handler(struct deadline *deadline) {
+	(void)deadline;
+	(void)check_movement_reminder(&process_data_work);
+	check_telemetry_submit(&process_data_work);
+	(void)check_incorrect_timeout(&process_data_work);
+	schedule_suspended_deadline();
+}
+
+POWER_STATS_DEADLINE_DEFINE(POWER_STATS_POSTURE, suspended_deadline_handler)
+
+static DEADLINE_DEFINE(suspended_deadline, POWER_STATS_HANDLER(suspended_deadline_handler));
+
+static void schedule_suspended_deadline(void) {
+	int64_t delay_ms = next_deadline_ms(&process_data_work) - k_uptime_get();
+	deadline_arm(&suspended_deadline, MAX(delay_ms, 0));
+}
+
+void posture_detection_suspend(void) {
+	if (process_data_work.state_start_ts == 0) {
+		// No data processed yet, nothing to keep track of
 		return;
 	}
-	process_data_work.data = *data;
+	LOG_INF("Posture detection suspended");
+	schedule_suspended_deadline();
+}
+
+void posture_detection_resume(void) {
+	LOG_INF("Posture detection resumed");
+	(void)deadline_cancel(&suspended_deadline);
+}
+
+static bool queue_update(const struct posture_data *data) {
+	struct posture_data *slot = spsc_acquire(&posture_queue);
+	if (slot == NULL) {
+		return false;
+	}
+	*slot = *data;
+	spsc_produce(&posture_queue);
+	return true;
+}
+
+void posture_detection_update(struct posture_data *data) {
+	k_spinlock_key_t key = k_spin_lock(&staged_lock);
+	if (staged_update.valid && queue_update(&staged_update.data)) {
+		staged_update.valid = false;
+	}
+	if (staged_update.valid) {
+		unsigned peak = MAX(staged_update.data.cm_s2_max_accel_diff,
+				    data->cm_s2_max_accel_diff);
+		uint32_t fetch_cyc = staged_update.data.fetch_cyc;
+		staged_update.data = *data;
+		staged_update.data.cm_s2_max_accel_diff = peak;
+		// Latency is measured from the oldest sample merged in
+		staged_update.data.fetch_cyc = fetch_cyc;
+		atomic_inc(&updates_coalesced);
+	} else if (!queue_update(data)) {
+		staged_update.data = *data;
+		staged_update.valid = true;
+	}
+
+	int backlog = spsc_consumable(&posture_queue) + staged_update.valid;
+	k_spin_unlock(&staged_lock, key);
+	if (backlog > atomic_get(&updates_backlog_max)) {
+		atomic_set(&updates_backlog_max, backlog);
+	}
 	k_work_submit(&process_data_work.work);
 }
+
+void posture_detection_get_queue_stats(struct posture_queue_stats *stats) {
+	stats->coalesced = atomic_get(&updates_coalesced);
+	stats->backlog_max = atomic_get(&updates_backlog_max);
+}
+
 void posture_detection_do_calibration(void) {
 	calibration_flag = true;
 }
@@ -229,11 +409,27 @@ struct posture_settings posture_detection_get_settings() {
 	return settings;
 }
 
-void posture_detection_save_settings(void) {
-	int rc = settings_save();
+static void settings_save_handler(struct k_work *work) {
+	(void)work;
+	int rc = settings_save_one(SETTINGS_NAME, &settings, sizeof(settings));
 	if (rc < 0) {
 		LOG_ERR("Failed to save settings %d", rc);
 	} else {
 		LOG_INF("Settings saved");
 	}
 }
+
+static K_WORK_DELAYABLE_DEFINE(settings_save_work, settings_save_handler);
+
+void posture_detection_save_settings(void) {
+	// Restart the window so a burst of changes ends in a single write
+	k_work_reschedule(&settings_save_work, K_MSEC(SETTINGS_SAVE_DELAY_MS));
+}
+
+void posture_detection_flush_settings(void) {
+	struct k_work_sync sync;
+	// Still pending means there are unsaved changes
+	if (k_work_cancel_delayable_sync(&settings_save_work, &sync)) {
+		settings_save_handler(NULL);
+	}
+}
@@ -0,0 +1,112 @@
+#include "app/power_stats.h"
+
+#include <errno.h>
+
+#include <zephyr/init.h>
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+#include <zephyr/sys/atomic.h>
+
+#ifdef CONFIG_CPU_CORTEX_M_HAS_DWT
+#include <cmsis_core.h>
+#endif
+
+/*
+ * Time is measured in CPU cycles where the DWT cycle counter exists: it
+ * stops while the core sleeps, so it counts exactly the active time. The
+ * kernel cycle counter (32 kHz RTC on nRF) is the fallback.
+ *
+ * Counts are bumped from the BT RX thread and the trace writer queue too, so
+ * they are atomic. Cycles are only added by the work handlers, which all run
+ * on the system workqueue.
+ */
+
+static struct {
+	atomic_t count;
+	uint64_t cycles;
+} stats[POWER_STATS_COUNT];
+
+static const char *const names[POWER_STATS_COUNT] = {
+    [POWER_STATS_SENSOR] = "sensor",
+    [POWER_STATS_POSTURE] = "posture",
+    [POWER_STATS_TELEMETRY] = "telemetry",
+    [POWER_STATS_TRANSFER] = "transfer",
+    [POWER_STATS_ADVERTISING] = "advertising",
+    [POWER_STATS_VIBRATION] = "vibration",
+    [POWER_STATS_BT_TX] = "bt_tx",
+    [POWER_STATS_BT_RX] = "bt_rx",
+    [POWER_STATS_FLASH_WRITE] = "flash_write",
+    [POWER_STATS_FLASH_ERASE] = "flash_erase",
+};
+
+static inline uint32_t cycles_now(void) {
+#ifdef CONFIG_CPU_CORTEX_M_HAS_DWT
+	return DWT->CYCCNT;
+#else
+	return k_cycle_get_32();
+#endif
+}
+
+static inline uint64_t cycles_per_sec(void) {
+#ifdef CONFIG_CPU_CORTEX_M_HAS_DWT
+	return SystemCoreClock;
+#else
+	return sys_clock_hw_cycles_per_sec();
+#endif
+}
+
+uint32_t power_stats_begin(void) {
+	return cycles_now();
+}
+
+void power_stats_end(enum power_stats_id id, uint32_t start) {
+	atomic_inc(&stats[id].count);
+	stats[id].cycles += (uint32_t)(cycles_now() - start);
+}
+
+void power_stats_count(enum power_stats_id id) {
+	atomic_inc(&stats[id].count);
+}
+
+int power_stats_get(enum power_stats_id id, struct power_stats_entry *entry) {
+	if (id >= POWER_STATS_COUNT) {
+		return -EINVAL;
+	}
+	// Readers on other threads may see a slightly stale pair, that's fine
+	entry->count = atomic_get(&stats[id].count);
+	entry->time_us = stats[id].cycles * USEC_PER_SEC / cycles_per_sec();
+	return 0;
+}
+
+const char *power_stats_name(enum power_stats_id id) {
+	return id < POWER_STATS_COUNT ? names[id] : NULL;
+}
+
+static int power_stats_init(void) {
+#ifdef CONFIG_CPU_CORTEX_M_HAS_DWT
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+	return 0;
+}
+
+SYS_INIT(power_stats_init, APPLICATION, 0);
+
+#ifdef CONFIG_SHELL
+static int cmd_power_stats(const struct shell *sh, size_t argc, char **argv) {
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	shell_print(sh, "uptime %lld ms", k_uptime_get());
+	shell_print(sh, "%-12s %10s %12s", "subsystem", "count", "cpu [us]");
+	for (int id = 0; id < POWER_STATS_COUNT; id++) {
+		struct power_stats_entry entry;
+		(void)power_stats_get(id, &entry);
+		shell_print(sh, "%-12s %10u %12u", names[id], entry.count, entry.time_us);
+	}
+	return 0;
+}
+
+SHELL_CMD_REGISTER(power_stats, NULL, "Wakeups and CPU time per subsystem", cmd_power_stats);
+#endif
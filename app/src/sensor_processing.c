@@ -1,17 +1,34 @@
 #include "zephyr/drivers/sensor.h"
 #include "zephyr/logging/log.h"
-#include <math.h>
+#include <stdlib.h>
+#ifdef CONFIG_APP_SENSOR_ASYNC
+#include "zephyr/rtio/rtio.h"
+#endif
 
 #include "app/sensor_processing.h"
 #include "app/posture_detection.h"
+#include "app/bmi160_ext.h"
+#include "app/deadline_scheduler.h"
+#include "app/fixed_math.h"
+#include "app/latency_stats.h"
+#include "app/power_stats.h"
+#include "app/tilt_fusion.h"
+#include "app/trace_recorder.h"
+#include "app/trace_replay.h"
 
 LOG_MODULE_REGISTER(sensor_processing, LOG_LEVEL_INF);
 
-#define M_PI 3.14159265358979323846
-
 #define MOVEMENT_THRESHOLD 200u
 
-#define MEASUREMENTS_POOL 10
+#define WINDOW_SIZE CONFIG_APP_SENSOR_WINDOW_SIZE
+
+// Longest time a single sample may stand for in the window averages
+#define MAX_SAMPLE_WEIGHT_MS 1000u
+
+#define FIFO_READ_CHUNK 16
+
+// Longer gaps (e.g. after parking) restart the fusion from the accelerometer
+#define FUSION_MAX_DT_US 1000000u
 
 struct accel_cm_s2_ts {
   int16_t x;
@@ -20,12 +37,69 @@ struct accel_cm_s2_ts {
   int32_t timestamp;
 };
 
+struct norm_diff {
+  uint32_t seq;
+  uint16_t diff;
+};
+
+/* Sliding window over the last WINDOW_SIZE samples. Sums are kept running and
+ * the maximum difference between consecutive norms is tracked with a
+ * monotonic deque, so every sample costs O(1) amortized.
+ *
+ * The sample period may change while the window is filled. Each sample is
+ * weighted by the time since its predecessor and norm differences are scaled
+ * to the base sample period, so the outputs don't depend on the rate. */
+struct accel_window {
+  uint16_t norms[WINDOW_SIZE];
+  uint16_t weights[WINDOW_SIZE];
+  struct accel_cm_s2_ts samples[WINDOW_SIZE];
+  unsigned head;
+  unsigned count;
+  uint32_t seq;
+  int64_t sum_x;
+  int64_t sum_y;
+  int64_t sum_z;
+  uint32_t sum_weights;
+  // Differences in decreasing order, the front is the window maximum
+  struct norm_diff diffs[WINDOW_SIZE];
+  unsigned diffs_front;
+  unsigned diffs_len;
+};
+
 struct proceess_sensor_arg {
-  struct k_work_delayable work;
+  struct deadline deadline;
   const struct device *accel_sensor;
-  struct accel_cm_s2_ts last_measurements[MEASUREMENTS_POOL];
-  unsigned measurement_used;
+  struct accel_window window;
+  // Samples pushed since the last posture_data update
+  unsigned since_update;
+  // Current period of the samples fed into the window
+  uint32_t period_ms;
   int64_t start_ts;
+  bool fifo_active;
+  // Virtual timestamp of the next FIFO frame
+  int64_t fifo_ts_us;
+  // Time accumulated since the last FIFO frame fed into the window
+  uint32_t fifo_phase_us;
+  // Largest movement of the full windows passed in the current FIFO batch
+  unsigned batch_max_diff;
+  // Last time a window exceeded MOVEMENT_THRESHOLD
+  int64_t last_movement_ts;
+  bool parked;
+  // Parked, but the gyroscope is starting up for the first read
+  bool waking;
+#ifdef CONFIG_APP_SENSOR_ADAPTIVE_RATE
+  // Posture state the rate policy last saw and when it changed
+  enum posture_state rate_state;
+  int64_t rate_state_ts;
+  // ODR last applied to the sensor, 0 while it runs at its default
+  uint32_t odr_mhz;
+#endif
+  // Start of the fetch that delivered the newest sample
+  uint32_t fetch_cyc;
+#ifdef CONFIG_APP_SENSOR_FUSION
+  struct tilt_fusion fusion;
+  int32_t fusion_ts;
+#endif
 };
 
 struct angle {
@@ -47,51 +121,641 @@ from_sensor_vals(const struct sensor_value val[3]) {
   };
 }
 
-static struct angle
-accel_to_avg_angle(const struct accel_cm_s2_ts accels[MEASUREMENTS_POOL]) {
-  int32_t x = 0;
-  int32_t y = 0;
-  int32_t z = 0;
-  for (unsigned i = 0; i < MEASUREMENTS_POOL; i++) {
-    x += accels[i].x;
-    y += accels[i].y;
-    z += accels[i].z;
+static inline unsigned norm_accel(const struct accel_cm_s2_ts accel) {
+  // Squares of int16 axes sum up to at most 3 * 2^30, fits unsigned
+  uint32_t norm_sq = (uint32_t)(accel.x * accel.x) +
+                     (uint32_t)(accel.y * accel.y) +
+                     (uint32_t)(accel.z * accel.z);
+  return fixed_isqrt(norm_sq);
+}
+
+static void window_reset(struct accel_window *window) {
+  *window = (struct accel_window){0};
+}
+
+static inline bool window_is_full(const struct accel_window *window) {
+  return window->count == WINDOW_SIZE;
+}
+
+static void window_push_diff(struct accel_window *window, uint16_t diff) {
+  // Smaller differences can never become the maximum again
+  while (window->diffs_len > 0) {
+    unsigned back = (window->diffs_front + window->diffs_len - 1) % WINDOW_SIZE;
+    if (window->diffs[back].diff > diff) {
+      break;
+    }
+    window->diffs_len--;
+  }
+  unsigned slot = (window->diffs_front + window->diffs_len) % WINDOW_SIZE;
+  window->diffs[slot] = (struct norm_diff){.seq = window->seq, .diff = diff};
+  window->diffs_len++;
+}
+
+/* period_ms is the current sample period, it weights the first sample */
+static void window_push(struct accel_window *window,
+                        const struct accel_cm_s2_ts sample, uint32_t period_ms) {
+  unsigned slot = window->head;
+  unsigned prev = (slot + WINDOW_SIZE - 1) % WINDOW_SIZE;
+  uint32_t dt_ms = period_ms;
+  if (window->seq > 0) {
+    dt_ms = (uint32_t)(sample.timestamp - window->samples[prev].timestamp);
+  }
+  uint16_t weight = CLAMP(dt_ms, 1u, MAX_SAMPLE_WEIGHT_MS);
+
+  if (window_is_full(window)) {
+    const struct accel_cm_s2_ts *oldest = &window->samples[slot];
+    uint16_t oldest_weight = window->weights[slot];
+    window->sum_x -= (int32_t)oldest->x * oldest_weight;
+    window->sum_y -= (int32_t)oldest->y * oldest_weight;
+    window->sum_z -= (int32_t)oldest->z * oldest_weight;
+    window->sum_weights -= oldest_weight;
+  } else {
+    window->count++;
   }
-  x /= MEASUREMENTS_POOL;
-  y /= MEASUREMENTS_POOL;
-  z /= MEASUREMENTS_POOL;
+  window->samples[slot] = sample;
+  window->weights[slot] = weight;
+  window->sum_x += (int32_t)sample.x * weight;
+  window->sum_y += (int32_t)sample.y * weight;
+  window->sum_z += (int32_t)sample.z * weight;
+  window->sum_weights += weight;
+
+  uint16_t norm = norm_accel(sample);
+  if (window->seq > 0) {
+    // Change per base sample period, a longer gap sees proportionally more
+    uint32_t diff = abs(norm - window->norms[prev]);
+    if (weight > CONFIG_APP_SENSOR_SAMPLE_PERIOD_MS) {
+      diff = diff * CONFIG_APP_SENSOR_SAMPLE_PERIOD_MS / weight;
+    }
+    window_push_diff(window, MIN(diff, UINT16_MAX));
+  }
+  window->norms[slot] = norm;
+  window->head = (slot + 1) % WINDOW_SIZE;
+  window->seq++;
+
+  // A difference is tagged with its later sample, it expires together with
+  // the earlier one
+  while (window->diffs_len > 0 &&
+         window->seq - window->diffs[window->diffs_front].seq >= WINDOW_SIZE) {
+    window->diffs_front = (window->diffs_front + 1) % WINDOW_SIZE;
+    window->diffs_len--;
+  }
+}
+
+static struct angle accel_to_avg_angle(const struct accel_window *window) {
+  int32_t x = (int32_t)(window->sum_x / window->sum_weights);
+  int32_t y = (int32_t)(window->sum_y / window->sum_weights);
+  int32_t z = (int32_t)(window->sum_z / window->sum_weights);
 
-  float main_angle_rad = atan2f((float)z, (float)y);
-  float side_angle_rad = atan2f((float)x, (float)y);
   return (struct angle){
-      .main = (int16_t)(main_angle_rad * 180.0f / (float)M_PI),
-      .side = (int16_t)(side_angle_rad * 180.0f / (float)M_PI),
+      .main = fixed_atan2_deg(z, y),
+      .side = fixed_atan2_deg(x, y),
   };
 }
 
-static inline unsigned norm_accel(const struct accel_cm_s2_ts accel) {
-  return sqrtf(accel.x * accel.x + accel.y * accel.y + accel.z * accel.z);
-}
-
-static unsigned
-max_accel_diff(const struct accel_cm_s2_ts values[MEASUREMENTS_POOL]) {
-    unsigned max_diff = 0;
-    int norm = norm_accel(values[0]);
-  for (unsigned i = 1; i < MEASUREMENTS_POOL; i++) {
-    int norm_i = norm_accel(values[i]);
-    unsigned diff = abs(norm_i - norm);
-    if (diff > max_diff) {
-        max_diff = diff;
+static unsigned max_accel_diff(const struct accel_window *window) {
+  if (window->diffs_len == 0) {
+    return 0;
+  }
+  return window->diffs[window->diffs_front].diff;
+}
+
+#ifdef CONFIG_APP_SENSOR_FUSION
+static inline int32_t gyro_to_mdeg_s(const struct sensor_value val) {
+  int64_t urad_s = (int64_t)val.val1 * 1000000 + val.val2;
+  return (int32_t)(urad_s * 57296 / 1000000);
+}
+
+static void fuse_measurement(struct proceess_sensor_arg *arg_struct,
+                             const struct accel_cm_s2_ts accel,
+                             int32_t gyro_x, int32_t gyro_z, uint32_t dt_us) {
+  if (dt_us > FUSION_MAX_DT_US) {
+    tilt_fusion_reset(&arg_struct->fusion);
+  }
+  tilt_fusion_update(&arg_struct->fusion, accel.x, accel.y, accel.z, gyro_x,
+                     gyro_z, dt_us);
+  arg_struct->fusion_ts = accel.timestamp;
+}
+#endif
+
+static void push_measurement(struct proceess_sensor_arg *arg_struct,
+                             const struct accel_cm_s2_ts measurement) {
+  window_push(&arg_struct->window, measurement, arg_struct->period_ms);
+  arg_struct->since_update++;
+  trace_recorder_add(measurement.timestamp, measurement.x, measurement.y,
+                     measurement.z);
+}
+
+/* Publishes posture_data once the window is full and enough new samples
+ * arrived since the previous update. */
+static void publish_window(struct proceess_sensor_arg *arg_struct) {
+  const struct accel_window *window = &arg_struct->window;
+  if (!window_is_full(window) ||
+      arg_struct->since_update < CONFIG_APP_SENSOR_UPDATE_INTERVAL) {
+    return;
+  }
+
+  trace_replay_window_begin();
+  // A FIFO batch is published once, keep the movement of its earlier windows
+  unsigned max_acc_diff = MAX(max_accel_diff(window), arg_struct->batch_max_diff);
+  arg_struct->batch_max_diff = 0;
+  struct angle angles = accel_to_avg_angle(window);
+  bool angles_fused = false;
+#ifdef CONFIG_APP_SENSOR_FUSION
+  if (arg_struct->fusion.initialized) {
+    angles.main = tilt_fusion_main_deg(&arg_struct->fusion);
+    angles.side = tilt_fusion_side_deg(&arg_struct->fusion);
+    angles_fused = true;
+  }
+#endif
+  trace_replay_window_end();
+  LOG_DBG("Movement_detected: %d, Angles: %d, %d", max_acc_diff, angles.main,
+          angles.side);
+  struct posture_data data = {
+      .x_angle = angles.main,
+      .y_angle = angles.side,
+      .cm_s2_max_accel_diff = max_acc_diff,
+      .angles_fused = angles_fused,
+      .fetch_cyc = arg_struct->fetch_cyc,
+      .window_cyc = latency_stats_now(),
+  };
+  latency_stats_record(LATENCY_STAGE_WINDOW, data.fetch_cyc, data.window_cyc);
+  posture_detection_update(&data);
+
+  if (max_acc_diff > MOVEMENT_THRESHOLD) {
+    arg_struct->last_movement_ts = k_uptime_get();
+  }
+  arg_struct->since_update = 0;
+  arg_struct->start_ts = k_uptime_get();
+}
+
+/* Gyro rates are only used with CONFIG_APP_SENSOR_FUSION */
+static void handle_measurement(struct proceess_sensor_arg *arg_struct,
+                               const struct accel_cm_s2_ts measurement,
+                               int32_t gyro_x, int32_t gyro_z) {
+#ifdef CONFIG_APP_SENSOR_FUSION
+  uint32_t dt_us =
+      (uint32_t)(measurement.timestamp - arg_struct->fusion_ts) * 1000u;
+  fuse_measurement(arg_struct, measurement, gyro_x, gyro_z, dt_us);
+#else
+  ARG_UNUSED(gyro_x);
+  ARG_UNUSED(gyro_z);
+#endif
+  push_measurement(arg_struct, measurement);
+  publish_window(arg_struct);
+}
+
+static int poll_sensor(struct proceess_sensor_arg *arg_struct) {
+  const struct device *sensor = arg_struct->accel_sensor;
+  arg_struct->fetch_cyc = latency_stats_now();
+  int rc = sensor_sample_fetch(sensor);
+  if (rc == -ENODATA) {
+    LOG_INF("Sensor stream ended. Stopping processing");
+    trace_replay_finish();
+    return rc;
+  } else if (rc < 0) {
+    LOG_ERR("Sensor fetch error. Stopping processing");
+    return -EIO;
+  }
+  struct sensor_value val[3];
+
+  if (sensor_channel_get(sensor, SENSOR_CHAN_ACCEL_XYZ, val) < 0) {
+    LOG_ERR("Sensor data get error. Stopping processing");
+    return -EIO;
+  }
+
+  struct accel_cm_s2_ts measurement = from_sensor_vals(val);
+  int32_t gyro_x = 0;
+  int32_t gyro_z = 0;
+#ifdef CONFIG_APP_SENSOR_FUSION
+  struct sensor_value gyro[3];
+  if (sensor_channel_get(sensor, SENSOR_CHAN_GYRO_XYZ, gyro) < 0) {
+    LOG_ERR("Gyro data get error. Stopping processing");
+    return -EIO;
+  }
+  gyro_x = gyro_to_mdeg_s(gyro[0]);
+  gyro_z = gyro_to_mdeg_s(gyro[2]);
+#endif
+  // The workqueue was blocked for the whole bus transfer
+  uint32_t read_cyc = latency_stats_now();
+  latency_stats_record(LATENCY_STAGE_SENSOR_READ, arg_struct->fetch_cyc, read_cyc);
+  latency_stats_record(LATENCY_STAGE_SENSOR_BLOCKED, arg_struct->fetch_cyc, read_cyc);
+
+  handle_measurement(arg_struct, measurement, gyro_x, gyro_z);
+  return 0;
+}
+
+#ifdef CONFIG_APP_SENSOR_ADAPTIVE_RATE
+/* Lowest BMI160 rate delivering at least two samples per period, the
+ * gyroscope needs 25 Hz or more. */
+static uint32_t odr_for_period_mhz(uint32_t period_ms) {
+  uint32_t odr_mhz = IS_ENABLED(CONFIG_APP_SENSOR_FUSION) ? 25000 : 12500;
+  while (odr_mhz * period_ms < 2 * USEC_PER_SEC && odr_mhz < 1600000) {
+    odr_mhz *= 2;
+  }
+  return odr_mhz;
+}
+#endif
+
+#ifdef CONFIG_APP_SENSOR_FIFO
+static int drain_fifo(struct proceess_sensor_arg *arg_struct) {
+  static struct bmi160_fifo_sample samples[FIFO_READ_CHUNK];
+  uint32_t frame_period_us = bmi160_fifo_frame_period_us();
+  int read;
+
+  do {
+    arg_struct->fetch_cyc = latency_stats_now();
+    read = bmi160_fifo_read(samples, ARRAY_SIZE(samples));
+    if (read < 0) {
+      LOG_ERR("FIFO read error. Stopping processing");
+      return read;
     }
-    norm = norm_i;
+    for (int i = 0; i < read; i++) {
+      arg_struct->fifo_ts_us += frame_period_us;
+      arg_struct->fifo_phase_us += frame_period_us;
+      struct accel_cm_s2_ts measurement = {
+          .x = samples[i].x,
+          .y = samples[i].y,
+          .z = samples[i].z,
+          .timestamp = (int32_t)(arg_struct->fifo_ts_us / 1000),
+      };
+#ifdef CONFIG_APP_SENSOR_FUSION
+      // The gyro is integrated at the full ODR, only the window is decimated
+      fuse_measurement(arg_struct, measurement, samples[i].gyro_x,
+                       samples[i].gyro_z, frame_period_us);
+#endif
+      // The FIFO runs at the accelerometer ODR, keep feeding the window at
+      // the current sample period so the posture output does not change
+      uint32_t sample_period_us = arg_struct->period_ms * 1000u;
+      if (arg_struct->fifo_phase_us < sample_period_us) {
+        continue;
+      }
+      arg_struct->fifo_phase_us %= sample_period_us;
+      push_measurement(arg_struct, measurement);
+      if (window_is_full(&arg_struct->window)) {
+        arg_struct->batch_max_diff = MAX(arg_struct->batch_max_diff,
+                                         max_accel_diff(&arg_struct->window));
+      }
+    }
+  } while (read == ARRAY_SIZE(samples));
+  // Angles come from the newest window, the movement peak from the whole batch
+  publish_window(arg_struct);
+
+  // Re-anchor the virtual clock if the sensor oscillator drifted away
+  int64_t now_us = k_uptime_get() * 1000;
+  if (llabs(now_us - arg_struct->fifo_ts_us) > 2 * frame_period_us) {
+    arg_struct->fifo_ts_us = now_us;
+  }
+  return 0;
+}
+
+/* Drains the same number of frames per batch at any rate, so a slower ODR
+ * never overflows the FIFO and wakes the CPU proportionally less. */
+static uint32_t fifo_drain_period_ms(const struct proceess_sensor_arg *arg_struct) {
+#ifdef CONFIG_APP_SENSOR_ADAPTIVE_RATE
+  if (arg_struct->odr_mhz != 0) {
+    return (uint64_t)CONFIG_APP_SENSOR_FIFO_DRAIN_PERIOD_MS *
+           odr_for_period_mhz(CONFIG_APP_SENSOR_SAMPLE_PERIOD_MS) /
+           arg_struct->odr_mhz;
+  }
+#else
+  ARG_UNUSED(arg_struct);
+#endif
+  return CONFIG_APP_SENSOR_FIFO_DRAIN_PERIOD_MS;
+}
+#endif
+
+#ifdef CONFIG_APP_SENSOR_MOTION_GATING
+static struct proceess_sensor_arg sensor_arg;
+
+static const struct sensor_trigger motion_trigger = {
+    .type = SENSOR_TRIG_DELTA,
+    .chan = SENSOR_CHAN_ACCEL_XYZ,
+};
+
+static void motion_handler(const struct device *dev,
+                           const struct sensor_trigger *trigger) {
+  (void)dev;
+  (void)trigger;
+  // Resuming is done by process_sensor itself
+  deadline_arm(&sensor_arg.deadline, 0);
+}
+
+static int configure_motion_detection(const struct device *sensor) {
+  struct sensor_value slope_th;
+  struct sensor_value slope_dur = {
+      .val1 = CONFIG_APP_SENSOR_MOTION_GATING_DURATION,
+  };
+  sensor_value_from_milli(&slope_th, CONFIG_APP_SENSOR_MOTION_GATING_THRESHOLD);
+  if (sensor_attr_set(sensor, SENSOR_CHAN_ACCEL_XYZ, SENSOR_ATTR_SLOPE_TH,
+                      &slope_th) < 0 ||
+      sensor_attr_set(sensor, SENSOR_CHAN_ACCEL_XYZ, SENSOR_ATTR_SLOPE_DUR,
+                      &slope_dur) < 0) {
+    LOG_ERR("Failed to configure any-motion detection");
+    return -EIO;
+  }
+  return 0;
+}
+
+static bool park_sampling(struct proceess_sensor_arg *arg_struct) {
+  if (sensor_trigger_set(arg_struct->accel_sensor, &motion_trigger,
+                         motion_handler) < 0) {
+    LOG_WRN("Failed to arm any-motion trigger, sampling continues");
+    arg_struct->last_movement_ts = k_uptime_get();
+    return false;
+  }
+  arg_struct->parked = true;
+  window_reset(&arg_struct->window);
+  arg_struct->since_update = 0;
+#ifdef CONFIG_APP_SENSOR_FUSION
+  tilt_fusion_reset(&arg_struct->fusion);
+  (void)bmi160_gyro_set_power(false);
+#endif
+  posture_detection_suspend();
+  LOG_INF("No movement, sampling parked");
+  return true;
+}
+
+/* Returns how long the first read has to wait for the sensor. The system
+ * workqueue must not sleep through the gyroscope start-up. */
+static uint32_t wake_sampling(struct proceess_sensor_arg *arg_struct) {
+  (void)sensor_trigger_set(arg_struct->accel_sensor, &motion_trigger, NULL);
+  arg_struct->waking = true;
+#ifdef CONFIG_APP_SENSOR_FUSION
+  if (bmi160_gyro_set_power(true) == 0) {
+    return BMI160_GYRO_STARTUP_MS;
+  }
+#endif
+  return 0;
+}
+
+static void unpark_sampling(struct proceess_sensor_arg *arg_struct) {
+  arg_struct->parked = false;
+  arg_struct->waking = false;
+  arg_struct->last_movement_ts = k_uptime_get();
+#ifdef CONFIG_APP_SENSOR_FIFO
+  // Drop whatever piled up in the FIFO while parked
+  if (arg_struct->fifo_active &&
+      bmi160_fifo_start(IS_ENABLED(CONFIG_APP_SENSOR_FUSION)) == 0) {
+    arg_struct->fifo_ts_us = k_uptime_get() * 1000;
+    arg_struct->fifo_phase_us = 0;
+  }
+#endif
+  posture_detection_resume();
+  LOG_INF("Motion detected, sampling resumed");
+}
+
+static inline bool is_still(const struct proceess_sensor_arg *arg_struct) {
+  return k_uptime_get() - arg_struct->last_movement_ts >=
+         CONFIG_APP_SENSOR_MOTION_GATING_IDLE_S * MSEC_PER_SEC;
+}
+#endif
+
+#ifdef CONFIG_APP_SENSOR_ADAPTIVE_RATE
+/* Sensors without runtime ODR keep their rate and are just read less
+ * often. */
+static int set_sensor_odr(struct proceess_sensor_arg *arg_struct,
+                          uint32_t period_ms) {
+  uint32_t odr_mhz = odr_for_period_mhz(period_ms);
+  struct sensor_value odr = {
+      .val1 = odr_mhz / 1000,
+      .val2 = (odr_mhz % 1000) * 1000,
+  };
+  int rc = sensor_attr_set(arg_struct->accel_sensor, SENSOR_CHAN_ACCEL_XYZ,
+                           SENSOR_ATTR_SAMPLING_FREQUENCY, &odr);
+  if (rc < 0) {
+    LOG_DBG("ODR %u mHz not applied (%d)", odr_mhz, rc);
+    return rc;
+  }
+  arg_struct->odr_mhz = odr_mhz;
+#ifdef CONFIG_APP_SENSOR_FIFO
+  // The FIFO frame period follows the ODR, restart it at the new rate
+  if (arg_struct->fifo_active &&
+      bmi160_fifo_start(IS_ENABLED(CONFIG_APP_SENSOR_FUSION)) == 0) {
+    arg_struct->fifo_ts_us = k_uptime_get() * 1000;
+    arg_struct->fifo_phase_us = 0;
+  }
+#endif
+  return 0;
+}
+
+static const uint16_t rate_policy_ms[] = {
+    [POSTURE_STATE_CORRECT] = CONFIG_APP_SENSOR_RATE_CORRECT_MS,
+    [POSTURE_STATE_INVALID] = CONFIG_APP_SENSOR_RATE_INVALID_MS,
+    [POSTURE_STATE_MOVEMENTS] = CONFIG_APP_SENSOR_RATE_MOVEMENTS_MS,
+    [POSTURE_STATE_INCORRECT] = CONFIG_APP_SENSOR_RATE_INCORRECT_MS,
+};
+
+static uint32_t wanted_period_ms(struct proceess_sensor_arg *arg_struct) {
+  int64_t now = k_uptime_get();
+  enum posture_state state = posture_detection_get_state();
+  if (state != arg_struct->rate_state) {
+    arg_struct->rate_state = state;
+    arg_struct->rate_state_ts = now;
+  }
+  // Sample at the base rate while a state change may be coming up
+  int64_t hold_ms = CONFIG_APP_SENSOR_RATE_HOLD_S * MSEC_PER_SEC;
+  if (now - arg_struct->rate_state_ts < hold_ms ||
+      now - arg_struct->last_movement_ts < hold_ms) {
+    return CONFIG_APP_SENSOR_SAMPLE_PERIOD_MS;
   }
-  return max_diff;
+  return rate_policy_ms[state];
 }
 
-static void process_sensor(struct k_work *work) {
-  struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+static void adapt_rate(struct proceess_sensor_arg *arg_struct) {
+  uint32_t period_ms = wanted_period_ms(arg_struct);
+  if (period_ms == arg_struct->period_ms) {
+    return;
+  }
+  (void)set_sensor_odr(arg_struct, period_ms);
+  arg_struct->period_ms = period_ms;
+  LOG_INF("Sample period %u ms", period_ms);
+}
+#endif
+
+/* Runs after a sample or FIFO batch went through the window */
+static void finish_cycle(struct proceess_sensor_arg *arg_struct) {
+#ifdef CONFIG_APP_SENSOR_MOTION_GATING
+  if (is_still(arg_struct) && park_sampling(arg_struct)) {
+    return;
+  }
+#endif
+#ifdef CONFIG_APP_SENSOR_ADAPTIVE_RATE
+  adapt_rate(arg_struct);
+#endif
+  uint32_t next_run_ms = arg_struct->period_ms;
+#ifdef CONFIG_APP_SENSOR_FIFO
+  if (arg_struct->fifo_active) {
+    next_run_ms = fifo_drain_period_ms(arg_struct);
+  }
+#endif
+
+  deadline_arm(&arg_struct->deadline, next_run_ms);
+}
+
+#ifdef CONFIG_APP_SENSOR_ASYNC
+/*
+ * Reads go through the sensor RTIO API, so the system workqueue only
+ * submits the transfer and decodes the result. Drivers without a native
+ * submit run the fetch on the RTIO work queue instead. One read is in
+ * flight at a time, the next one is armed once this one is processed.
+ * A failed read cancels the chained callback, the sensor deadline doubles
+ * as a timeout to pick up its completion. A read that is merely slow is
+ * waited for, never submitted a second time.
+ */
+#define ASYNC_READ_TIMEOUT_MS 100
+
+#ifdef CONFIG_APP_SENSOR_FUSION
+SENSOR_DT_READ_IODEV(accel_iodev, DT_ALIAS(accel0), {SENSOR_CHAN_ACCEL_XYZ, 0},
+                     {SENSOR_CHAN_GYRO_XYZ, 0});
+#else
+SENSOR_DT_READ_IODEV(accel_iodev, DT_ALIAS(accel0), {SENSOR_CHAN_ACCEL_XYZ, 0});
+#endif
+
+RTIO_DEFINE_WITH_MEMPOOL(sensor_rtio, 4, 4, 4, 64, sizeof(void *));
+
+static struct proceess_sensor_arg sensor_arg;
+
+// Outside sensor_arg so a read submitted before a stop still counts
+static bool read_in_flight;
+
+static void async_read_done(struct k_work *work);
+POWER_STATS_HANDLER_DECLARE(async_read_done)
+static K_WORK_DEFINE(async_read_work, POWER_STATS_HANDLER(async_read_done));
+
+// Chained behind the read, runs in whatever context completed it
+static void async_read_complete(struct rtio *r, const struct rtio_sqe *sqe,
+                                void *arg) {
+  ARG_UNUSED(r);
+  ARG_UNUSED(sqe);
+  ARG_UNUSED(arg);
+  k_work_submit(&async_read_work);
+}
+
+static int start_async_read(struct proceess_sensor_arg *arg_struct) {
+  struct rtio_sqe *read_sqe = rtio_sqe_acquire(&sensor_rtio);
+  struct rtio_sqe *done_sqe = rtio_sqe_acquire(&sensor_rtio);
+  if (read_sqe == NULL || done_sqe == NULL) {
+    rtio_sqe_drop_all(&sensor_rtio);
+    return -ENOMEM;
+  }
+  arg_struct->fetch_cyc = latency_stats_now();
+  rtio_sqe_prep_read_with_pool(read_sqe, &accel_iodev, RTIO_PRIO_NORM,
+                               arg_struct);
+  read_sqe->flags |= RTIO_SQE_CHAINED;
+  rtio_sqe_prep_callback_no_cqe(done_sqe, async_read_complete, NULL, NULL);
+  int rc = rtio_submit(&sensor_rtio, 0);
+  latency_stats_record(LATENCY_STAGE_SENSOR_BLOCKED, arg_struct->fetch_cyc,
+                       latency_stats_now());
+  if (rc == 0) {
+    read_in_flight = true;
+    deadline_arm(&arg_struct->deadline, ASYNC_READ_TIMEOUT_MS);
+  }
+  return rc;
+}
+
+// Decoded values are value * 2^shift / 2^31 in SI units
+static inline int32_t q31_to_milli(q31_t value, int8_t shift) {
+  int64_t scaled = (int64_t)value * 1000;
+  return (int32_t)(shift >= 0 ? (scaled * (1LL << shift)) >> 31
+                              : scaled >> (31 - shift));
+}
+
+static int decode_reading(const uint8_t *buf,
+                          struct accel_cm_s2_ts *measurement,
+                          int32_t *gyro_x, int32_t *gyro_z) {
+  const struct sensor_decoder_api *decoder;
+  int rc = sensor_get_decoder(sensor_arg.accel_sensor, &decoder);
+  if (rc < 0) {
+    return rc;
+  }
+
+  struct sensor_three_axis_data accel;
+  struct sensor_decode_context ctx =
+      SENSOR_DECODE_CONTEXT_INIT(decoder, buf, SENSOR_CHAN_ACCEL_XYZ, 0);
+  if (sensor_decode(&ctx, &accel, 1) != 1) {
+    return -EIO;
+  }
+  *measurement = (struct accel_cm_s2_ts){
+      .x = (int16_t)q31_to_milli(accel.readings[0].x, accel.shift),
+      .y = (int16_t)q31_to_milli(accel.readings[0].y, accel.shift),
+      .z = (int16_t)q31_to_milli(accel.readings[0].z, accel.shift),
+      .timestamp = (int32_t)(accel.header.base_timestamp_ns / NSEC_PER_MSEC),
+  };
+
+#ifdef CONFIG_APP_SENSOR_FUSION
+  struct sensor_three_axis_data gyro;
+  ctx = (struct sensor_decode_context)SENSOR_DECODE_CONTEXT_INIT(
+      decoder, buf, SENSOR_CHAN_GYRO_XYZ, 0);
+  if (sensor_decode(&ctx, &gyro, 1) != 1) {
+    return -EIO;
+  }
+  // mrad/s to mdeg/s
+  *gyro_x = (int32_t)((int64_t)q31_to_milli(gyro.readings[0].x, gyro.shift) *
+                      57296 / 1000);
+  *gyro_z = (int32_t)((int64_t)q31_to_milli(gyro.readings[0].z, gyro.shift) *
+                      57296 / 1000);
+#else
+  *gyro_x = 0;
+  *gyro_z = 0;
+#endif
+  return 0;
+}
+
+/* Returns 0 if the read hasn't completed yet, 1 once it was processed and
+ * negative errno if sampling stopped. */
+static int complete_async_read(struct proceess_sensor_arg *arg_struct) {
+  struct rtio_cqe *cqe = rtio_cqe_consume(&sensor_rtio);
+  if (cqe == NULL) {
+    return 0;
+  }
+  read_in_flight = false;
+  int rc = cqe->result;
+  uint8_t *buf = NULL;
+  uint32_t buf_len = 0;
+  if (rc >= 0) {
+    rc = rtio_cqe_get_mempool_buffer(&sensor_rtio, cqe, &buf, &buf_len);
+  }
+  rtio_cqe_release(&sensor_rtio, cqe);
+  latency_stats_record(LATENCY_STAGE_SENSOR_READ, arg_struct->fetch_cyc,
+                       latency_stats_now());
+
+  struct accel_cm_s2_ts measurement;
+  int32_t gyro_x;
+  int32_t gyro_z;
+  if (rc >= 0 && arg_struct->accel_sensor != NULL) {
+    rc = decode_reading(buf, &measurement, &gyro_x, &gyro_z);
+  }
+  rtio_release_buffer(&sensor_rtio, buf, buf_len);
+  trace_replay_sample_end();
+  if (arg_struct->accel_sensor == NULL) {
+    // Stopped while the read was in flight
+    return -ECANCELED;
+  }
+  if (rc == -ENODATA) {
+    LOG_INF("Sensor stream ended. Stopping processing");
+    trace_replay_finish();
+    return rc;
+  } else if (rc < 0) {
+    LOG_ERR("Async sensor read error %d. Stopping processing", rc);
+    return rc;
+  }
+
+  handle_measurement(arg_struct, measurement, gyro_x, gyro_z);
+  finish_cycle(arg_struct);
+  return 1;
+}
+
+static void async_read_done(struct k_work *work) {
+  ARG_UNUSED(work);
+  (void)complete_async_read(&sensor_arg);
+}
+
+POWER_STATS_HANDLER_DEFINE(POWER_STATS_SENSOR, async_read_done)
+#endif
+
+static void process_sensor(struct deadline *deadline) {
   struct proceess_sensor_arg *arg_struct =
-      CONTAINER_OF(dwork, struct proceess_sensor_arg, work);
+      CONTAINER_OF(deadline, struct proceess_sensor_arg, deadline);
   const struct device *sensor = arg_struct->accel_sensor;
   if (sensor == NULL) {
     LOG_ERR("Sensor not present. Stoping processing");
@@ -100,60 +764,119 @@ static void process_sensor(struct k_work *work) {
   // In case the function is called for the first time
   if (arg_struct->start_ts == 0) {
     arg_struct->start_ts = k_uptime_get();
+    arg_struct->last_movement_ts = arg_struct->start_ts;
   }
 
-  if (sensor_sample_fetch(sensor) < 0) {
-    LOG_ERR("Sensor fetch error. Stopping processing");
+#ifdef CONFIG_APP_SENSOR_ASYNC
+  if (read_in_flight) {
+    // Timed out waiting for async_read_done()
+    if (complete_async_read(arg_struct) != 0) {
+      return;
+    }
+    // Still owned by the driver, resubmitting would queue a second read
+    LOG_WRN("Sensor read timed out, still waiting");
+    deadline_arm(&arg_struct->deadline, ASYNC_READ_TIMEOUT_MS);
     return;
   }
-  struct sensor_value val[3];
+#endif
 
-  if (sensor_channel_get(sensor, SENSOR_CHAN_ACCEL_XYZ, val) < 0) {
-    LOG_ERR("Sensor data get error. Stopping processing");
-    return;
+#ifdef CONFIG_APP_SENSOR_MOTION_GATING
+  if (arg_struct->parked) {
+    if (!arg_struct->waking) {
+      uint32_t startup_ms = wake_sampling(arg_struct);
+      if (startup_ms > 0) {
+        deadline_arm(&arg_struct->deadline, startup_ms);
+        return;
+      }
+    }
+    unpark_sampling(arg_struct);
   }
+#endif
 
-  struct accel_cm_s2_ts measurement = from_sensor_vals(val);
-  arg_struct->last_measurements[arg_struct->measurement_used] = measurement;
-  arg_struct->measurement_used++;
-
-  if (arg_struct->measurement_used >= MEASUREMENTS_POOL) {
-    unsigned max_acc_diff =
-        max_accel_diff(arg_struct->last_measurements);
-    struct angle angles = accel_to_avg_angle(arg_struct->last_measurements);
-    LOG_DBG("Movement_detected: %d, Angles: %d, %d", max_acc_diff,
-            angles.main, angles.side);
-    struct posture_data data = {
-        .x_angle = angles.main,
-        .y_angle = angles.side,
-        .cm_s2_max_accel_diff = max_acc_diff,
-    };
-    posture_detection_update(&data);
-
-    arg_struct->measurement_used = 0;
-    arg_struct->start_ts = k_uptime_get();
+  trace_replay_sample_begin();
+  int rc;
+#ifdef CONFIG_APP_SENSOR_FIFO
+  if (arg_struct->fifo_active) {
+    rc = drain_fifo(arg_struct);
+  } else
+#endif
+  {
+#ifdef CONFIG_APP_SENSOR_ASYNC
+    if (start_async_read(arg_struct) == 0) {
+      // Continues in async_read_done() once the transfer completes
+      return;
+    }
+#endif
+    rc = poll_sensor(arg_struct);
   }
-
-  k_work_reschedule(&arg_struct->work, K_MSEC(50));
+  trace_replay_sample_end();
+  if (rc < 0) {
+    return;
+  }
+  finish_cycle(arg_struct);
 }
 
+POWER_STATS_DEADLINE_DEFINE(POWER_STATS_SENSOR, process_sensor)
+
 static struct proceess_sensor_arg sensor_arg = {
     .accel_sensor = NULL,
-    .measurement_used = 0,
+    .since_update = 0,
     .start_ts = 0,
 };
 
 void sensor_processing_start(const struct device *const accel_sensor) {
   sensor_arg.accel_sensor = accel_sensor;
-  k_work_init_delayable(&sensor_arg.work, process_sensor);
-  k_work_schedule(&sensor_arg.work, K_MSEC(50));
+  sensor_arg.period_ms = CONFIG_APP_SENSOR_SAMPLE_PERIOD_MS;
+#ifdef CONFIG_APP_SENSOR_ADAPTIVE_RATE
+  // The FIFO is started below and picks the rate up from the sensor
+  (void)set_sensor_odr(&sensor_arg, sensor_arg.period_ms);
+#endif
+#ifdef CONFIG_APP_SENSOR_MOTION_GATING
+  (void)configure_motion_detection(accel_sensor);
+#endif
+#ifdef CONFIG_APP_SENSOR_FUSION
+  // Parking may have left it suspended. Without fusion the driver keeps it
+  // off itself (BMI160_GYRO_PMU_SUSPEND).
+  if (bmi160_gyro_set_power(true) == 0) {
+    // Called from main, blocking here keeps the FIFO free of start-up frames
+    k_msleep(BMI160_GYRO_STARTUP_MS);
+  }
+#endif
+  uint32_t first_run_ms = CONFIG_APP_SENSOR_SAMPLE_PERIOD_MS;
+#ifdef CONFIG_APP_SENSOR_FIFO
+  if (bmi160_fifo_start(IS_ENABLED(CONFIG_APP_SENSOR_FUSION)) == 0) {
+    sensor_arg.fifo_active = true;
+    sensor_arg.fifo_ts_us = k_uptime_get() * 1000;
+    first_run_ms = CONFIG_APP_SENSOR_FIFO_DRAIN_PERIOD_MS;
+  } else {
+    LOG_WRN("FIFO unavailable, falling back to polling");
+  }
+#endif
+  deadline_init(&sensor_arg.deadline, POWER_STATS_HANDLER(process_sensor));
+  deadline_arm(&sensor_arg.deadline, first_run_ms);
 }
 
 void sensor_processing_stop(void) {
   if (sensor_arg.accel_sensor == NULL) {
     return;
   }
+#ifdef CONFIG_APP_SENSOR_MOTION_GATING
+  // Disarm first so the trigger can't re-arm the deadline after cancelling
+  (void)sensor_trigger_set(sensor_arg.accel_sensor, &motion_trigger, NULL);
+  if (sensor_arg.parked) {
+    posture_detection_resume();
+  }
+#endif
+  (void)deadline_cancel_sync(&sensor_arg.deadline);
+#ifdef CONFIG_APP_SENSOR_ASYNC
+  // A read still in flight finds accel_sensor cleared and is dropped
   struct k_work_sync sync;
-  k_work_cancel_delayable_sync(&sensor_arg.work, &sync);
+  (void)k_work_cancel_sync(&async_read_work, &sync);
+#endif
+#ifdef CONFIG_APP_SENSOR_FIFO
+  if (sensor_arg.fifo_active) {
+    (void)bmi160_fifo_stop();
+  }
+#endif
   sensor_arg = (struct proceess_sensor_arg){};
 }
@@ -1,18 +1,86 @@
 #include "app/telemetry_storage.h"
+#include "app/power_stats.h"
+#include "app/trace_replay.h"
+
+#include <string.h>
 
 #include <zephyr/logging/log.h>
 
 #include "zephyr/fs/fcb.h"
 #include "zephyr/kernel.h"
+#include "zephyr/settings/settings.h"
+#include "zephyr/storage/flash_map.h"
+#include "zephyr/sys/atomic.h"
+#include "zephyr/sys/byteorder.h"
+#include "zephyr/sys/crc.h"
+#include "zephyr/sys/spsc_lockfree.h"
 
 LOG_MODULE_REGISTER(telemetry_storage, LOG_LEVEL_DBG);
 
-struct telemetry_work {
-	struct k_work work;
-	struct telemetry telemetry;
-};
+#define TELEMETRY_QUEUE_LEN 8 /* power of two */
+
+static void telemetry_handle(struct k_work *work);
+POWER_STATS_HANDLER_DECLARE(telemetry_handle)
+
+/*
+ * posture_detection is the only producer and telemetry_handle() the only
+ * consumer, so the records travel through a lock-free SPSC ring and the
+ * work item just gets resubmitted.
+ */
+SPSC_DEFINE(telemetry_queue, struct telemetry, TELEMETRY_QUEUE_LEN);
+static K_WORK_DEFINE(telemetry_work, POWER_STATS_HANDLER(telemetry_handle));
+static atomic_t telemetry_dropped;
+static atomic_t telemetry_queued_max;
+
+/*
+ * Write-behind buffer: records collect here and go to flash as one FCB
+ * entry once the buffer is full or telemetry_storage_flush() is called.
+ * The mutex also serializes the FCB writer against flushes coming from
+ * other threads (power button, transfer start).
+ */
+static K_MUTEX_DEFINE(batch_lock);
+
+static struct {
+	struct telemetry records[CONFIG_APP_TELEMETRY_BATCH_SIZE];
+	size_t count;
+	/* Sequence number of records[0] */
+	uint32_t first_seq;
+} batch;
+
+/* Sequence numbers start at 1, next_seq is guarded by batch_lock. */
+static uint32_t next_seq = 1;
+
+/* First sequence number handed out since boot */
+static uint32_t boot_seq = 1;
+
+/* Last sequence number acknowledged by the central, persisted in settings. */
+static uint32_t acked_seq;
+
+static int telemetry_settings_set(const char *name, size_t len, settings_read_cb read_cb,
+				  void *cb_arg) {
+	if (strcmp(name, "cursor") != 0) {
+		return -ENOENT;
+	}
+	if (len != sizeof(acked_seq)) {
+		return -EINVAL;
+	}
+	int rc = read_cb(cb_arg, &acked_seq, sizeof(acked_seq));
+	return rc < 0 ? rc : 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(telemetry, "telemetry", NULL, telemetry_settings_set, NULL, NULL);
+
+#define CURSOR_SAVE_DELAY_MS 2000
+
+static void cursor_save_handler(struct k_work *work) {
+	(void)work;
+	int rc = settings_save_one("telemetry/cursor", &acked_seq, sizeof(acked_seq));
+	if (rc != 0) {
+		LOG_ERR("Failed to save telemetry cursor: %d", rc);
+	}
+}
 
-static struct telemetry_work work;
+static K_WORK_DELAYABLE_DEFINE(cursor_save_work, cursor_save_handler);
 
 #define SECTOR_SIZE 0x1000 /* 4K */
 
@@ -30,93 +98,535 @@ static struct fcb telemetry_storage = {
     .f_sectors = fcb_sector,
     .f_scratch_cnt = 0,
     .f_magic = 0xFBCB,
-    .f_version = 1,
+    .f_version = 3,
 };
 
-static void telemetry_handle(struct k_work *work) {
-	struct telemetry_work *telemetry_work = CONTAINER_OF(work, struct telemetry_work, work);
-	struct telemetry *telemetry = &telemetry_work->telemetry;
-	// TODO: Fix telemetry timestamp
-	telemetry->timestamp = k_uptime_get();
-	LOG_INF("Telemetry data: %d", telemetry->timestamp);
+/*
+ * On-flash record format (f_version 3).
+ *
+ * Every FCB entry starts with the varint sequence number of its first record
+ * and the varint record count, followed by the records. The first record of an entry
+ * stores its timestamp as an absolute varint and the following records store
+ * a zigzag varint delta to the previous record, so entries decode on their
+ * own and survive fcb_rotate() dropping older sectors. The counters are
+ * plain unsigned LEB128 varints, which keeps the typical half-hour record at
+ * well under the 12 bytes of the in-RAM struct.
+ */
+#define TELEMETRY_RECORD_MAX_ENCODED 18 /* 5 + 2 * 2 + 3 * 3 */
+#define TELEMETRY_ENTRY_MAX_RECORDS CONFIG_APP_TELEMETRY_BATCH_SIZE
+#define TELEMETRY_ENTRY_HEADER_MAX 10 /* 5 + 5 */
+#define TELEMETRY_ENTRY_MAX_LEN                                                                    \
+	(TELEMETRY_ENTRY_HEADER_MAX + TELEMETRY_ENTRY_MAX_RECORDS * TELEMETRY_RECORD_MAX_ENCODED)
+
+/* Largest flash write block supported, the nRF52 needs 4 */
+#define FLASH_WRITE_ALIGN_MAX 8
+
+static size_t varint_put(uint8_t *buf, uint32_t value) {
+	size_t len = 0;
+	while (value >= 0x80) {
+		buf[len++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	buf[len++] = (uint8_t)value;
+	return len;
+}
+
+static int varint_get(const uint8_t *buf, size_t len, size_t *pos, uint32_t *value) {
+	uint32_t result = 0;
+	for (unsigned int shift = 0; shift < 35; shift += 7) {
+		if (*pos >= len) {
+			return -EBADMSG;
+		}
+		uint8_t byte = buf[(*pos)++];
+		result |= (uint32_t)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) {
+			*value = result;
+			return 0;
+		}
+	}
+	return -EBADMSG;
+}
+
+static size_t telemetry_encode(const struct telemetry *records, size_t count, uint32_t first_seq,
+			       uint8_t *buf) {
+	size_t len = varint_put(buf, first_seq);
+	len += varint_put(buf + len, count);
+	for (size_t i = 0; i < count; i++) {
+		const struct telemetry *t = &records[i];
+		if (i == 0) {
+			len += varint_put(buf + len, t->timestamp);
+		} else {
+			int32_t delta = (int32_t)(t->timestamp - records[i - 1].timestamp);
+			len += varint_put(buf + len, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+		}
+		len += varint_put(buf + len, t->posture_notifications);
+		len += varint_put(buf + len, t->activeness_notifications);
+		len += varint_put(buf + len, t->seconds_not_moving);
+		len += varint_put(buf + len, t->seconds_in_bad_posture);
+		len += varint_put(buf + len, t->seconds_in_good_posture);
+	}
+	return len;
+}
+
+static int telemetry_decode(const uint8_t *buf, size_t len, size_t *pos, bool first,
+			    struct telemetry *t) {
+	uint32_t ts, pn, an, not_moving, bad, good;
+	int rc = varint_get(buf, len, pos, &ts);
+	rc = rc ?: varint_get(buf, len, pos, &pn);
+	rc = rc ?: varint_get(buf, len, pos, &an);
+	rc = rc ?: varint_get(buf, len, pos, &not_moving);
+	rc = rc ?: varint_get(buf, len, pos, &bad);
+	rc = rc ?: varint_get(buf, len, pos, &good);
+	if (rc != 0) {
+		return rc;
+	}
+	if (first) {
+		t->timestamp = ts;
+	} else {
+		t->timestamp += (uint32_t)((int32_t)(ts >> 1) ^ -(int32_t)(ts & 1));
+	}
+	t->posture_notifications = pn;
+	t->activeness_notifications = an;
+	t->seconds_not_moving = not_moving;
+	t->seconds_in_bad_posture = bad;
+	t->seconds_in_good_posture = good;
+	return 0;
+}
+
+static inline uint32_t fcb_aligned(uint32_t len) {
+        uint8_t align = MAX(telemetry_storage.f_align, 1);
+        return ROUND_UP(len, align);
+}
+
+/* Called with batch_lock held. */
+static int batch_commit(void) {
+	static uint8_t encoded[ROUND_UP(TELEMETRY_ENTRY_MAX_LEN, FLASH_WRITE_ALIGN_MAX)];
+
+	if (batch.count == 0) {
+		return 0;
+	}
+	size_t encoded_len = telemetry_encode(batch.records, batch.count, batch.first_seq, encoded);
+	LOG_DBG("Committing %zu telemetry records (%zu bytes)", batch.count, encoded_len);
+	batch.count = 0;
 
         struct fcb_entry entry;
-	int rc = fcb_append(&telemetry_storage, sizeof *telemetry, &entry);
+	int rc = fcb_append(&telemetry_storage, encoded_len, &entry);
         if (rc == -ENOSPC) {
                 LOG_INF("Rotating sectors");
                 rc = fcb_rotate(&telemetry_storage);
+                power_stats_count(POWER_STATS_FLASH_ERASE);
                 if (rc != 0) {
                         LOG_ERR("FCB rotate failed: %d", rc);
-                        return;
+                        return rc;
                 }
-                rc = fcb_append(&telemetry_storage, sizeof *telemetry, &entry);
+                rc = fcb_append(&telemetry_storage, encoded_len, &entry);
                 if (rc != 0) {
                         LOG_ERR("FCB append failed after rotation: %d", rc);
-                        return;
+                        return rc;
                 }
         } else if (rc < 0) {
                 LOG_ERR("FCB append failed: %d", rc);
-                return;
+                return rc;
         }
+        /*
+         * The FCB reserves the data area padded to the write block and the
+         * CRC only covers encoded_len, so pad with the erase value. Flash
+         * drivers reject writes that aren't a multiple of the block size.
+         */
+        size_t write_len = fcb_aligned(encoded_len);
+        memset(encoded + encoded_len, flash_area_erased_val(telemetry_storage.fap),
+               write_len - encoded_len);
         rc = flash_area_write(telemetry_storage.fap, FCB_ENTRY_FA_DATA_OFF(entry),
-                              telemetry, sizeof *telemetry);
+                              encoded, write_len);
+        power_stats_count(POWER_STATS_FLASH_WRITE);
         if (rc != 0) {
                 LOG_ERR("FCB write failed: %d", rc);
         }
         rc = fcb_append_finish(&telemetry_storage, &entry);
         if (rc != 0) {
                 LOG_ERR("FCB append finish failed: %d", rc);
-        
         }
+        return rc;
 }
 
+static void telemetry_handle(struct k_work *work) {
+	ARG_UNUSED(work);
+	struct telemetry *telemetry;
+
+	k_mutex_lock(&batch_lock, K_FOREVER);
+	while ((telemetry = spsc_consume(&telemetry_queue)) != NULL) {
+		LOG_INF("Telemetry data: %d", telemetry->timestamp);
+		trace_replay_on_telemetry(telemetry);
+		if (batch.count == 0) {
+			batch.first_seq = next_seq;
+		}
+		batch.records[batch.count++] = *telemetry;
+		next_seq++;
+		spsc_release(&telemetry_queue);
+		if (batch.count == ARRAY_SIZE(batch.records)) {
+			(void)batch_commit();
+		}
+	}
+	k_mutex_unlock(&batch_lock);
+}
+
+POWER_STATS_HANDLER_DEFINE(POWER_STATS_TELEMETRY, telemetry_handle)
+
 void telemetry_storage_submit(struct telemetry *telemetry) {
-	if (k_work_is_pending(&work.work)) {
+	struct telemetry *slot = spsc_acquire(&telemetry_queue);
+	if (slot == NULL) {
+		atomic_inc(&telemetry_dropped);
+		LOG_WRN("Telemetry queue full, record dropped");
 		return;
 	}
-	k_work_init(&work.work, telemetry_handle);
-	work.telemetry = *telemetry;
-	k_work_submit(&work.work);
+	*slot = *telemetry;
+	// TODO: Fix telemetry timestamp
+	slot->timestamp = k_uptime_get();
+	spsc_produce(&telemetry_queue);
+
+	int queued = spsc_consumable(&telemetry_queue);
+	if (queued > atomic_get(&telemetry_queued_max)) {
+		atomic_set(&telemetry_queued_max, queued);
+	}
+	k_work_submit(&telemetry_work);
+}
+
+void telemetry_storage_get_stats(struct telemetry_storage_stats *stats) {
+	stats->dropped = atomic_get(&telemetry_dropped);
+	stats->queued_max = atomic_get(&telemetry_queued_max);
+}
+
+int telemetry_storage_flush(void) {
+	struct k_work_sync sync;
+	if (k_work_cancel_delayable_sync(&cursor_save_work, &sync)) {
+		cursor_save_handler(NULL);
+	}
+
+	k_mutex_lock(&batch_lock, K_FOREVER);
+	int rc = batch_commit();
+	k_mutex_unlock(&batch_lock);
+	return rc;
+}
+
+/*
+ * The export walks the FCB sectors itself so a whole window of entries comes
+ * in with one flash read, instead of fcb_getnext() reading the length and
+ * the CRC data of every entry and another read for the payload. Layout as
+ * written by subsys/fs/fcb (flash erased to 0xff): a sector header, then
+ * entries of [length, 1 or 2 bytes][data][crc8], each field padded to the
+ * flash write alignment.
+ */
+struct fcb_sector_header {
+	uint32_t magic;
+	uint8_t version;
+	uint8_t pad;
+	uint16_t id;
+};
+
+#define EXPORT_WINDOW_SIZE 1024
+
+/* Length and CRC fields padded to at most 8 bytes each */
+BUILD_ASSERT(EXPORT_WINDOW_SIZE >= TELEMETRY_ENTRY_MAX_LEN + 2 * 8,
+	     "A telemetry entry has to fit into the export window");
+
+/* Sequential decoder over the FCB log, shared by the full dump and the sync. */
+static struct {
+        struct flash_sector *sector;
+        uint32_t off;
+        uint8_t window[EXPORT_WINDOW_SIZE];
+        uint32_t window_off;
+        size_t window_len;
+
+        const uint8_t *data;
+        size_t len;
+        size_t pos;
+        uint32_t first_seq;
+        uint32_t seq;
+        uint32_t remaining;
+        uint32_t min_seq;
+        struct telemetry last;
+} reader;
+
+/* Make [off, off + len) of the current sector available in the window. */
+static const uint8_t *reader_window(uint32_t off, size_t len) {
+        if (off < reader.window_off || off + len > reader.window_off + reader.window_len) {
+                size_t read_len = MIN(sizeof(reader.window), reader.sector->fs_size - off);
+                int rc = flash_area_read(telemetry_storage.fap, reader.sector->fs_off + off,
+                                         reader.window, read_len);
+                if (rc != 0) {
+                        LOG_ERR("Telemetry read failed: %d", rc);
+                        reader.window_len = 0;
+                        return NULL;
+                }
+                reader.window_off = off;
+                reader.window_len = read_len;
+        }
+        return reader.window + (off - reader.window_off);
+}
+
+static void reader_next_sector(void) {
+        if (reader.sector == telemetry_storage.f_active.fe_sector) {
+                reader.sector = NULL;
+                return;
+        }
+        reader.sector++;
+        if (reader.sector == &telemetry_storage.f_sectors[telemetry_storage.f_sector_cnt]) {
+                reader.sector = telemetry_storage.f_sectors;
+        }
+        reader.off = 0;
+        reader.window_len = 0;
+}
+
+/* Points reader.data at the next entry with a valid CRC, returns 1 at the end. */
+static int reader_next_entry(void) {
+        while (reader.sector != NULL) {
+                if (reader.off == 0) {
+                        struct fcb_sector_header header;
+                        const uint8_t *raw = reader_window(0, sizeof(header));
+                        if (raw == NULL) {
+                                return -EIO;
+                        }
+                        memcpy(&header, raw, sizeof(header));
+                        if (header.magic != telemetry_storage.f_magic ||
+                            header.version != telemetry_storage.f_version) {
+                                reader_next_sector();
+                                continue;
+                        }
+                        reader.off = fcb_aligned(sizeof(header));
+                }
+
+                if (reader.off + 2 > reader.sector->fs_size) {
+                        reader_next_sector();
+                        continue;
+                }
+                const uint8_t *elem = reader_window(reader.off, 2);
+                if (elem == NULL) {
+                        return -EIO;
+                }
+                size_t len_bytes = 1;
+                uint16_t len = elem[0];
+                if (elem[0] & 0x80) {
+                        if (elem[0] == 0xff && elem[1] == 0xff) {
+                                // Erased, nothing more in this sector
+                                reader_next_sector();
+                                continue;
+                        }
+                        len = (elem[0] & 0x7f) | (elem[1] << 7);
+                        len_bytes = 2;
+                }
+                uint32_t data_off = reader.off + fcb_aligned(len_bytes);
+                uint32_t crc_off = data_off + fcb_aligned(len);
+                uint32_t next_off = crc_off + fcb_aligned(1);
+                if (next_off > reader.sector->fs_size) {
+                        reader_next_sector();
+                        continue;
+                }
+                uint32_t elem_off = reader.off;
+                reader.off = next_off;
+                if (next_off - elem_off > sizeof(reader.window)) {
+                        LOG_WRN("Skipping oversized telemetry entry (%u)", len);
+                        continue;
+                }
+                elem = reader_window(elem_off, next_off - elem_off);
+                if (elem == NULL) {
+                        return -EIO;
+                }
+                const uint8_t *data = elem + (data_off - elem_off);
+                uint8_t crc = crc8_ccitt(CRC8_CCITT_INITIAL_VALUE, elem, len_bytes);
+                crc = crc8_ccitt(crc, data, len);
+                if (crc != elem[crc_off - elem_off]) {
+                        // Torn or unfinished append, fcb_getnext() skips these too
+                        continue;
+                }
+                reader.data = data;
+                reader.len = len;
+                return 0;
+        }
+        return 1;
+}
+
+static int reader_load_entry(void) {
+        int rc = reader_next_entry();
+        if (rc != 0) {
+                return rc;
+        }
+        reader.remaining = 0;
+        reader.pos = 0;
+        uint32_t count;
+        rc = varint_get(reader.data, reader.len, &reader.pos, &reader.first_seq);
+        rc = rc ?: varint_get(reader.data, reader.len, &reader.pos, &count);
+        if (rc != 0) {
+                LOG_WRN("Corrupted telemetry entry header, skipping");
+                return 0;
+        }
+        if (reader.first_seq + count <= reader.min_seq) {
+                // Everything in this entry has been synced already
+                return 0;
+        }
+        reader.seq = reader.first_seq;
+        reader.remaining = count;
+        return 0;
+}
+
+/* Returns 0 with the next record at or after reader.min_seq, 1 at the end. */
+static int reader_next(struct telemetry *telemetry, uint32_t *seq) {
+        while (true) {
+                while (reader.remaining == 0) {
+                        int rc = reader_load_entry();
+                        if (rc != 0) {
+                                return rc;
+                        }
+                }
+                int rc = telemetry_decode(reader.data, reader.len, &reader.pos,
+                                          reader.seq == reader.first_seq, &reader.last);
+                if (rc != 0) {
+                        LOG_WRN("Corrupted telemetry entry, skipping");
+                        reader.remaining = 0;
+                        continue;
+                }
+                reader.remaining--;
+                *seq = reader.seq++;
+                if (*seq >= reader.min_seq) {
+                        *telemetry = reader.last;
+                        return 0;
+                }
+        }
+}
+
+static void reader_rewind(uint32_t min_seq) {
+        reader.sector = fcb_is_empty(&telemetry_storage) ? NULL : telemetry_storage.f_oldest;
+        reader.off = 0;
+        reader.window_len = 0;
+        reader.remaining = 0;
+        reader.min_seq = min_seq;
+}
+
+static void reader_reset(uint32_t min_seq) {
+        /* Make the records still sitting in RAM part of the transfer. */
+        (void)telemetry_storage_flush();
+        reader_rewind(min_seq);
 }
 
 int telemetry_get_portion(uint8_t *buf, size_t *len) {
-        static struct fcb_entry loc_ctx = {0};
         if (len == NULL) {
-                loc_ctx = (struct fcb_entry){0};
+                reader_reset(0);
                 return 0;
         }
         size_t write_off = 0;
         while (write_off + sizeof(struct telemetry) <= *len) {
-                int rc = fcb_getnext(&telemetry_storage, &loc_ctx);
-                if (rc == -ENOTSUP) {
+                struct telemetry telemetry;
+                uint32_t seq;
+                int rc = reader_next(&telemetry, &seq);
+                if (rc == 1) {
                         LOG_INF("FCB telem end");
                         *len = write_off;
                         return 1;
                 } else if (rc < 0) {
-                        LOG_ERR("FCB getnext failed: %d", rc);
                         return rc;
                 }
+                memcpy(buf + write_off, &telemetry, sizeof(telemetry));
+                write_off += sizeof(telemetry);
+        }
+        *len = write_off;
+        return 0;
+}
+
+int telemetry_get_sync_portion(uint8_t *buf, size_t *len) {
+        if (len == NULL) {
+                reader_reset(acked_seq + 1);
+                return 0;
+        }
+        size_t write_off = 0;
+        while (write_off + TELEMETRY_SYNC_RECORD_SIZE <= *len) {
                 struct telemetry telemetry;
-                rc = flash_area_read(telemetry_storage.fap, FCB_ENTRY_FA_DATA_OFF(loc_ctx),
-                                     &telemetry, sizeof(telemetry));
-                if (rc != 0) {
-                        LOG_ERR("FCB read failed: %d", rc);
+                uint32_t seq;
+                int rc = reader_next(&telemetry, &seq);
+                if (rc == 1) {
+                        LOG_INF("FCB telem sync end");
+                        *len = write_off;
+                        return 1;
+                } else if (rc < 0) {
                         return rc;
                 }
-                memcpy(buf + write_off, &telemetry, sizeof(telemetry));
-                write_off += sizeof(telemetry);
+                sys_put_le32(seq, buf + write_off);
+                memcpy(buf + write_off + sizeof(seq), &telemetry, sizeof(telemetry));
+                write_off += TELEMETRY_SYNC_RECORD_SIZE;
         }
         *len = write_off;
         return 0;
 }
 
+int telemetry_storage_ack(uint32_t seq) {
+        k_mutex_lock(&batch_lock, K_FOREVER);
+        uint32_t last_seq = next_seq - 1;
+        k_mutex_unlock(&batch_lock);
+        if (seq > last_seq) {
+                return -EINVAL;
+        }
+        if (seq <= acked_seq) {
+                return 0;
+        }
+        acked_seq = seq;
+        // Acks of consecutive syncs are coalesced into one flash write
+        k_work_reschedule(&cursor_save_work, K_MSEC(CURSOR_SAVE_DELAY_MS));
+        return 0;
+}
+
+uint32_t telemetry_storage_get_cursor(void) {
+        return acked_seq;
+}
+
+int telemetry_storage_count_since_boot(void) {
+        struct telemetry telemetry;
+        uint32_t seq;
+        int count = 0;
+        int rc;
+
+        reader_reset(boot_seq);
+        while ((rc = reader_next(&telemetry, &seq)) == 0) {
+                count++;
+        }
+        return rc < 0 ? rc : count;
+}
+
+/* Continue numbering after the newest stored or acknowledged record. */
+static void recover_next_seq(void) {
+        uint32_t last_seq = acked_seq;
+        reader_rewind(0);
+        while (reader_load_entry() == 0) {
+                if (reader.remaining > 0) {
+                        last_seq = MAX(last_seq, reader.first_seq + reader.remaining - 1);
+                }
+        }
+        next_seq = last_seq + 1;
+        boot_seq = next_seq;
+        LOG_INF("Telemetry sequence continues at %u, cursor %u", next_seq, acked_seq);
+}
+
 static int telemetry_storage_init(void) {
 	int rc = fcb_init(FIXED_PARTITION_ID(telemetry_partition), &telemetry_storage);
+	if (rc == -ENOMSG) {
+		/* Sectors written in the old raw-struct format; start over. */
+		LOG_WRN("Telemetry format changed, erasing old log");
+		const struct flash_area *fa;
+		rc = flash_area_open(FIXED_PARTITION_ID(telemetry_partition), &fa);
+		if (rc == 0) {
+			rc = flash_area_erase(fa, 0, fa->fa_size);
+			flash_area_close(fa);
+		}
+		if (rc == 0) {
+			rc = fcb_init(FIXED_PARTITION_ID(telemetry_partition), &telemetry_storage);
+		}
+	}
 	if (rc != 0) {
 		LOG_ERR("FCB init failed: %d", rc);
                 return rc;
 	}
-        // fcb_walk(&telemetry_storage, NULL, telemetry_walk_cb, NULL);
+	if (telemetry_storage.f_align > FLASH_WRITE_ALIGN_MAX) {
+		LOG_ERR("Flash write block %u not supported", telemetry_storage.f_align);
+		return -ENOTSUP;
+	}
+        recover_next_seq();
 	LOG_INF("FCB init success, Empyt: %d", fcb_is_empty(&telemetry_storage));
 	return rc;
 }
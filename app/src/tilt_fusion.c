@@ -0,0 +1,59 @@
+#include "app/tilt_fusion.h"
+
+#include "app/fixed_math.h"
+
+#define DEG_180_Q16 (180 << 16)
+#define DEG_360_Q16 (360 << 16)
+
+#define TIME_CONSTANT_US ((int64_t)CONFIG_APP_SENSOR_FUSION_TIME_CONSTANT_MS * 1000)
+
+// Gravity rotates against the device: rotating around +x lowers atan2(z, y),
+// rotating around +z raises atan2(x, y)
+#define MAIN_RATE_SIGN (-1)
+#define SIDE_RATE_SIGN 1
+
+static inline int32_t wrap_q16(int32_t angle) {
+  while (angle >= DEG_180_Q16) {
+    angle -= DEG_360_Q16;
+  }
+  while (angle < -DEG_180_Q16) {
+    angle += DEG_360_Q16;
+  }
+  return angle;
+}
+
+static int32_t fuse_axis(int32_t angle, int32_t rate_mdeg_s,
+                         int32_t accel_angle, uint32_t dt_us) {
+  // mdeg/s * us = 1e-9 deg
+  int64_t delta = (int64_t)rate_mdeg_s * dt_us * 65536 / 1000000000;
+  int32_t predicted = wrap_q16(angle + (int32_t)delta);
+
+  // First order low pass on the accelerometer correction
+  int32_t error = wrap_q16(accel_angle - predicted);
+  int32_t correction =
+      (int32_t)((int64_t)error * dt_us / (TIME_CONSTANT_US + dt_us));
+  return wrap_q16(predicted + correction);
+}
+
+void tilt_fusion_reset(struct tilt_fusion *fusion) {
+  *fusion = (struct tilt_fusion){0};
+}
+
+void tilt_fusion_update(struct tilt_fusion *fusion, int32_t accel_x,
+                        int32_t accel_y, int32_t accel_z, int32_t gyro_x,
+                        int32_t gyro_z, uint32_t dt_us) {
+  int32_t accel_main = fixed_atan2_q16(accel_z, accel_y);
+  int32_t accel_side = fixed_atan2_q16(accel_x, accel_y);
+
+  if (!fusion->initialized) {
+    fusion->main_q16 = accel_main;
+    fusion->side_q16 = accel_side;
+    fusion->initialized = true;
+    return;
+  }
+
+  fusion->main_q16 = fuse_axis(fusion->main_q16, MAIN_RATE_SIGN * gyro_x,
+                               accel_main, dt_us);
+  fusion->side_q16 = fuse_axis(fusion->side_q16, SIDE_RATE_SIGN * gyro_z,
+                               accel_side, dt_us);
+}
@@ -0,0 +1,305 @@
+#include "app/trace_recorder.h"
+#include "app/power_stats.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/atomic.h>
+
+#include <string.h>
+
+LOG_MODULE_REGISTER(trace_recorder, LOG_LEVEL_INF);
+
+#define PAGE_SIZE 0x1000 /* 4K */
+
+#define TRACE_PARTITION_SIZE FIXED_PARTITION_SIZE(trace_partition)
+#define HEADER_SIZE sizeof(struct trace_block_header)
+#define PAYLOAD_BITS ((TRACE_RECORDER_BLOCK_SIZE - HEADER_SIZE) * 8)
+
+#define WRITER_STACK_SIZE 1024
+
+BUILD_ASSERT(PAGE_SIZE % TRACE_RECORDER_BLOCK_SIZE == 0, "Blocks can't span pages");
+BUILD_ASSERT(TRACE_PARTITION_SIZE % PAGE_SIZE == 0, "Partition must be page aligned");
+
+struct trace_block {
+	struct k_work work;
+	off_t offset;
+	union {
+		struct trace_block_header header;
+		uint8_t data[TRACE_RECORDER_BLOCK_SIZE];
+	};
+};
+
+/* Double buffer: one block is filled on the sampling path while the other
+ * one is written to flash by the writer queue. */
+static struct trace_block blocks[2];
+static atomic_t blocks_busy;
+
+/* Encoder state, only touched from the system workqueue. */
+static struct {
+	struct trace_block *active;
+	size_t bit_pos;
+	int32_t prev_ts;
+	int16_t prev_x;
+	int16_t prev_y;
+	int16_t prev_z;
+	off_t next_offset;
+	uint16_t session;
+	bool recording;
+	uint32_t dropped_samples;
+} encoder;
+
+static const struct flash_area *trace_area;
+static atomic_t recorded_len;
+
+static atomic_t recording_requested;
+
+static struct k_work_q writer_queue;
+static K_THREAD_STACK_DEFINE(writer_stack, WRITER_STACK_SIZE);
+
+static void write_block(struct k_work *work) {
+	struct trace_block *block = CONTAINER_OF(work, struct trace_block, work);
+
+	int rc = 0;
+	if (block->offset % PAGE_SIZE == 0) {
+		rc = flash_area_erase(trace_area, block->offset, PAGE_SIZE);
+		power_stats_count(POWER_STATS_FLASH_ERASE);
+	}
+	if (rc == 0) {
+		rc = flash_area_write(trace_area, block->offset, block->data, sizeof(block->data));
+		power_stats_count(POWER_STATS_FLASH_WRITE);
+	}
+	if (rc != 0) {
+		LOG_ERR("Trace block write at %ld failed: %d", (long)block->offset, rc);
+	} else {
+		atomic_set(&recorded_len, block->offset + sizeof(block->data));
+	}
+	atomic_clear_bit(&blocks_busy, ARRAY_INDEX(blocks, block));
+}
+
+static struct trace_block *acquire_block(void) {
+	for (size_t i = 0; i < ARRAY_SIZE(blocks); i++) {
+		if (!atomic_test_and_set_bit(&blocks_busy, i)) {
+			return &blocks[i];
+		}
+	}
+	return NULL;
+}
+
+static void submit_active_block(void) {
+	struct trace_block *block = encoder.active;
+	encoder.active = NULL;
+	if (block == NULL) {
+		return;
+	}
+	if (encoder.next_offset + TRACE_RECORDER_BLOCK_SIZE > TRACE_PARTITION_SIZE) {
+		LOG_WRN("Trace partition full, recording stopped");
+		encoder.recording = false;
+		atomic_set(&recording_requested, false);
+		atomic_clear_bit(&blocks_busy, ARRAY_INDEX(blocks, block));
+		return;
+	}
+	block->offset = encoder.next_offset;
+	encoder.next_offset += TRACE_RECORDER_BLOCK_SIZE;
+	k_work_submit_to_queue(&writer_queue, &block->work);
+}
+
+static void put_bit(uint8_t *payload, bool bit) {
+	if (bit) {
+		payload[encoder.bit_pos / 8] |= BIT(encoder.bit_pos % 8);
+	}
+	encoder.bit_pos++;
+}
+
+static inline uint32_t zigzag(int32_t value) {
+	return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static inline unsigned exp_golomb_bits(uint32_t value) {
+	unsigned len = 32 - __builtin_clz(value + 1);
+	return 2 * len - 1;
+}
+
+static void put_exp_golomb(uint8_t *payload, uint32_t value) {
+	uint32_t coded = value + 1;
+	unsigned len = 32 - __builtin_clz(coded);
+	for (unsigned i = 1; i < len; i++) {
+		put_bit(payload, false);
+	}
+	for (unsigned i = len; i > 0; i--) {
+		put_bit(payload, coded & BIT(i - 1));
+	}
+}
+
+static void start_block(int32_t timestamp, int16_t x, int16_t y, int16_t z) {
+	struct trace_block *block = encoder.active;
+	memset(block->data, 0, sizeof(block->data));
+	block->header = (struct trace_block_header){
+		.magic = TRACE_RECORDER_MAGIC,
+		.session = encoder.session,
+		.timestamp = (uint32_t)timestamp,
+		.x = x,
+		.y = y,
+		.z = z,
+		.sample_count = 1,
+		.shift = CONFIG_APP_TRACE_RECORDER_RESOLUTION_SHIFT,
+		.period_ms = CONFIG_APP_SENSOR_SAMPLE_PERIOD_MS,
+	};
+	encoder.bit_pos = 0;
+}
+
+void trace_recorder_add(int32_t timestamp, int16_t x, int16_t y, int16_t z) {
+	if (!encoder.recording) {
+		return;
+	}
+	x >>= CONFIG_APP_TRACE_RECORDER_RESOLUTION_SHIFT;
+	y >>= CONFIG_APP_TRACE_RECORDER_RESOLUTION_SHIFT;
+	z >>= CONFIG_APP_TRACE_RECORDER_RESOLUTION_SHIFT;
+
+	if (encoder.active == NULL) {
+		encoder.active = acquire_block();
+		if (encoder.active == NULL) {
+			// Writer is still busy with the previous block
+			encoder.dropped_samples++;
+			return;
+		}
+		start_block(timestamp, x, y, z);
+	} else {
+		uint32_t codes[] = {
+			zigzag(timestamp - encoder.prev_ts - CONFIG_APP_SENSOR_SAMPLE_PERIOD_MS),
+			zigzag(x - encoder.prev_x),
+			zigzag(y - encoder.prev_y),
+			zigzag(z - encoder.prev_z),
+		};
+		size_t bits = 0;
+		for (size_t i = 0; i < ARRAY_SIZE(codes); i++) {
+			bits += exp_golomb_bits(codes[i]);
+		}
+
+		if (encoder.bit_pos + bits > PAYLOAD_BITS) {
+			submit_active_block();
+			// Start over with this sample as the base of a new block
+			encoder.active = encoder.recording ? acquire_block() : NULL;
+			if (encoder.active == NULL) {
+				encoder.dropped_samples++;
+				return;
+			}
+			start_block(timestamp, x, y, z);
+		} else {
+			uint8_t *payload = encoder.active->data + HEADER_SIZE;
+			for (size_t i = 0; i < ARRAY_SIZE(codes); i++) {
+				put_exp_golomb(payload, codes[i]);
+			}
+			encoder.active->header.sample_count++;
+		}
+	}
+
+	encoder.prev_ts = timestamp;
+	encoder.prev_x = x;
+	encoder.prev_y = y;
+	encoder.prev_z = z;
+}
+
+/* Start and stop run on the system workqueue, the same context as
+ * trace_recorder_add, so the encoder needs no locking. */
+
+static void recording_control(struct k_work *work) {
+	(void)work;
+	bool requested = atomic_get(&recording_requested);
+	if (requested == encoder.recording) {
+		return;
+	}
+	if (requested) {
+		encoder.session++;
+		encoder.next_offset = 0;
+		encoder.dropped_samples = 0;
+		atomic_set(&recorded_len, 0);
+		encoder.recording = true;
+		LOG_INF("Trace recording started, session %u", encoder.session);
+	} else {
+		submit_active_block();
+		encoder.recording = false;
+		LOG_INF("Trace recording stopped, %ld bytes, %u samples dropped",
+			(long)encoder.next_offset, encoder.dropped_samples);
+	}
+}
+
+static K_WORK_DEFINE(recording_control_work, recording_control);
+
+int trace_recorder_start(void) {
+	if (trace_area == NULL) {
+		return -ENODEV;
+	}
+	if (atomic_get(&blocks_busy) != 0 && !encoder.recording) {
+		// Blocks of the previous recording are still being written
+		return -EBUSY;
+	}
+	atomic_set(&recording_requested, true);
+	k_work_submit(&recording_control_work);
+	return 0;
+}
+
+void trace_recorder_stop(void) {
+	atomic_set(&recording_requested, false);
+	k_work_submit(&recording_control_work);
+}
+
+bool trace_recorder_is_recording(void) {
+	return encoder.recording || atomic_get(&blocks_busy) != 0;
+}
+
+int trace_recorder_read(size_t offset, uint8_t *buf, size_t len) {
+	if (trace_recorder_is_recording()) {
+		return -EBUSY;
+	}
+	size_t available = atomic_get(&recorded_len);
+	if (offset >= available) {
+		return 0;
+	}
+	len = MIN(len, available - offset);
+	int rc = flash_area_read(trace_area, offset, buf, len);
+	if (rc != 0) {
+		LOG_ERR("Trace read failed: %d", rc);
+		return rc;
+	}
+	return len;
+}
+
+/* Finds the end of the recording left in flash by a previous boot. */
+static void scan_recording(void) {
+	struct trace_block_header header;
+	off_t offset = 0;
+
+	while (offset + TRACE_RECORDER_BLOCK_SIZE <= TRACE_PARTITION_SIZE) {
+		if (flash_area_read(trace_area, offset, &header, sizeof(header)) != 0 ||
+		    header.magic != TRACE_RECORDER_MAGIC ||
+		    (offset != 0 && header.session != encoder.session)) {
+			break;
+		}
+		encoder.session = header.session;
+		offset += TRACE_RECORDER_BLOCK_SIZE;
+	}
+	atomic_set(&recorded_len, offset);
+	LOG_INF("Trace partition holds %ld bytes, session %u", (long)offset, encoder.session);
+}
+
+static int trace_recorder_init(void) {
+	int rc = flash_area_open(FIXED_PARTITION_ID(trace_partition), &trace_area);
+	if (rc != 0) {
+		LOG_ERR("Trace partition open failed: %d", rc);
+		trace_area = NULL;
+		return rc;
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(blocks); i++) {
+		k_work_init(&blocks[i].work, write_block);
+	}
+	k_work_queue_start(&writer_queue, writer_stack, K_THREAD_STACK_SIZEOF(writer_stack),
+			   K_LOWEST_APPLICATION_THREAD_PRIO, NULL);
+	k_thread_name_set(&writer_queue.thread, "trace_writer");
+
+	scan_recording();
+	return 0;
+}
+
+SYS_INIT(trace_recorder_init, APPLICATION, 2);
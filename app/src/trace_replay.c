@@ -0,0 +1,88 @@
+#include "app/trace_replay.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/printk.h>
+
+#include <posix_board_if.h>
+
+#include "trace_replay_bottom.h"
+
+/* Lines are printed with the virtual uptime so runs can be diffed. */
+
+static struct {
+        uint64_t sample_start_ns;
+        uint64_t sample_total_ns;
+        uint64_t sample_max_ns;
+        uint64_t window_start_ns;
+        uint64_t window_total_ns;
+        uint64_t window_max_ns;
+        uint32_t samples;
+        uint32_t windows;
+        uint32_t transitions;
+        uint32_t vibrations;
+        uint32_t telemetry_records;
+} stats;
+
+void trace_replay_sample_begin(void) {
+        stats.sample_start_ns = trace_replay_bottom_cpu_time_ns();
+}
+
+void trace_replay_sample_end(void) {
+        uint64_t elapsed = trace_replay_bottom_cpu_time_ns() - stats.sample_start_ns;
+
+        stats.samples++;
+        stats.sample_total_ns += elapsed;
+        stats.sample_max_ns = MAX(stats.sample_max_ns, elapsed);
+}
+
+void trace_replay_window_begin(void) {
+        stats.window_start_ns = trace_replay_bottom_cpu_time_ns();
+}
+
+void trace_replay_window_end(void) {
+        uint64_t elapsed = trace_replay_bottom_cpu_time_ns() - stats.window_start_ns;
+
+        stats.windows++;
+        stats.window_total_ns += elapsed;
+        stats.window_max_ns = MAX(stats.window_max_ns, elapsed);
+}
+
+void trace_replay_on_state(enum posture_state state) {
+        stats.transitions++;
+        printk("replay %lld state %d\n", k_uptime_get(), state);
+}
+
+void trace_replay_on_vibration(bool on) {
+        if (on) {
+                stats.vibrations++;
+        }
+        printk("replay %lld vibration %d\n", k_uptime_get(), on);
+}
+
+void trace_replay_on_telemetry(const struct telemetry *telemetry) {
+        stats.telemetry_records++;
+        printk("replay %lld telemetry %u %u %u %u %u\n", k_uptime_get(),
+               telemetry->posture_notifications, telemetry->activeness_notifications,
+               telemetry->seconds_not_moving, telemetry->seconds_in_bad_posture,
+               telemetry->seconds_in_good_posture);
+}
+
+void trace_replay_finish(void) {
+        uint64_t avg_ns = stats.samples ? stats.sample_total_ns / stats.samples : 0;
+        uint64_t window_avg_ns = stats.windows ? stats.window_total_ns / stats.windows : 0;
+
+        int stored = telemetry_storage_count_since_boot();
+
+        printk("replay %lld done: transitions %u vibrations %u telemetry %u stored %d\n",
+               k_uptime_get(), stats.transitions, stats.vibrations, stats.telemetry_records,
+               stored);
+        printk("replay cpu per sample: samples %u avg %llu ns max %llu ns\n", stats.samples,
+               avg_ns, stats.sample_max_ns);
+        printk("replay cpu per window: windows %u avg %llu ns max %llu ns\n", stats.windows,
+               window_avg_ns, stats.window_max_ns);
+        if (stored != (int)stats.telemetry_records) {
+                printk("replay telemetry lost in flash\n");
+                posix_exit(1);
+        }
+        posix_exit(0);
+}
@@ -0,0 +1,12 @@
+#include "trace_replay_bottom.h"
+
+#include <time.h>
+
+uint64_t trace_replay_bottom_cpu_time_ns(void) {
+        struct timespec ts;
+
+        if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0) {
+                return 0;
+        }
+        return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
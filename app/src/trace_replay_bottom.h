@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+/* CPU time of the simulator process on the host, in ns. */
+uint64_t trace_replay_bottom_cpu_time_ns(void);
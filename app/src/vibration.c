@@ -1,4 +1,7 @@
 #include "app/vibration.h"
+#include "app/deadline_scheduler.h"
+#include "app/power_stats.h"
+#include "app/trace_replay.h"
 
 #include <zephyr/drivers/gpio.h>
 
@@ -6,9 +9,11 @@ static const struct gpio_dt_spec vibration_control =
     GPIO_DT_SPEC_GET(DT_NODELABEL(vibration_output), gpios);
 static bool is_vibrating = false;
 
-static void vibration_work_handler(struct k_work *) { vibration_stop(); }
+static void vibration_deadline_handler(struct deadline *) { vibration_stop(); }
 
-static K_WORK_DELAYABLE_DEFINE(stop_vibration_work, vibration_work_handler);
+POWER_STATS_DEADLINE_DEFINE(POWER_STATS_VIBRATION, vibration_deadline_handler)
+
+static DEADLINE_DEFINE(stop_vibration_deadline, POWER_STATS_HANDLER(vibration_deadline_handler));
 
 void vibration_start(void) {
         if (is_vibrating) {
@@ -16,11 +21,14 @@ void vibration_start(void) {
         }
         is_vibrating = true;
         (void)gpio_pin_set_dt(&vibration_control, 1);
+        trace_replay_on_vibration(true);
 }
 
 void vibration_short_start(void) {
         vibration_start();
-        k_work_schedule(&stop_vibration_work, K_MSEC(VIBRATION_SHORT_DURATION));
+        if (!deadline_is_armed(&stop_vibration_deadline)) {
+                deadline_arm(&stop_vibration_deadline, VIBRATION_SHORT_DURATION);
+        }
 }
 
 void vibration_stop(void) {
@@ -29,6 +37,7 @@ void vibration_stop(void) {
         }
         is_vibrating = false;
         gpio_pin_set_dt(&vibration_control, 0);
+        trace_replay_on_vibration(false);
 }
 
 static int vibration_gpio_init(void) {
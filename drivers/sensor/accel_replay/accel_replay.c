@@ -0,0 +1,243 @@
+#define DT_DRV_COMPAT posture_tracker_accel_replay
+
+#include <zephyr/drivers/sensor.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <stdlib.h>
+
+#include <posix_native_task.h>
+
+#include "accel_replay_bottom.h"
+#include "cmdline.h"
+
+LOG_MODULE_REGISTER(accel_replay, CONFIG_SENSOR_LOG_LEVEL);
+
+struct accel_replay_row {
+        int64_t timestamp_ms;
+        int32_t accel[3];
+};
+
+struct accel_replay_data {
+        struct accel_replay_row current;
+        struct accel_replay_row next;
+        int64_t start_ms;
+        bool has_next;
+        bool started;
+
+        /* Any-motion emulation, see accel_replay_motion_work() */
+        const struct device *dev;
+        struct k_work_delayable motion_work;
+        sensor_trigger_handler_t motion_handler;
+        const struct sensor_trigger *motion_trigger;
+        int32_t slope_th_mm_s2;
+        uint8_t slope_dur;
+        uint8_t slope_count;
+        bool motion;
+};
+
+static char *trace_path;
+
+static int read_row(struct accel_replay_row *row) {
+        return accel_replay_bottom_read(&row->timestamp_ms, &row->accel[0], &row->accel[1],
+                                        &row->accel[2]);
+}
+
+/* Like the BMI160 any-motion engine: the slope between consecutive rows
+ * exceeds the threshold on any axis for slope_dur rows in a row. */
+static void check_slope(struct accel_replay_data *data, const struct accel_replay_row *prev) {
+        bool above = false;
+
+        for (unsigned i = 0; i < 3; i++) {
+                if (abs(data->current.accel[i] - prev->accel[i]) > data->slope_th_mm_s2) {
+                        above = true;
+                }
+        }
+        data->slope_count = above ? data->slope_count + 1 : 0;
+        if (data->slope_count >= data->slope_dur) {
+                data->motion = true;
+        }
+}
+
+/* Plays the trace against the uptime, the last row not in the future wins. */
+static int advance(struct accel_replay_data *data) {
+        if (!data->started) {
+                data->start_ms = k_uptime_get() - data->next.timestamp_ms;
+                data->started = true;
+        }
+
+        int64_t trace_now_ms = k_uptime_get() - data->start_ms;
+        while (data->has_next && data->next.timestamp_ms <= trace_now_ms) {
+                struct accel_replay_row prev = data->current;
+
+                data->current = data->next;
+                if (data->motion_handler != NULL) {
+                        check_slope(data, &prev);
+                }
+                int rc = read_row(&data->next);
+                if (rc < 0) {
+                        LOG_ERR("Failed to read trace");
+                        return -EIO;
+                }
+                data->has_next = rc == 1;
+        }
+        return 0;
+}
+
+static int accel_replay_sample_fetch(const struct device *dev, enum sensor_channel chan) {
+        struct accel_replay_data *data = dev->data;
+
+        __ASSERT_NO_MSG(chan == SENSOR_CHAN_ALL || chan == SENSOR_CHAN_ACCEL_XYZ);
+
+        if (!data->has_next) {
+                return -ENODATA;
+        }
+        return advance(data);
+}
+
+/*
+ * While the trigger is armed nobody fetches, so the trace is played from a
+ * work item woken at the next row. The end of the trace fires the trigger
+ * too, the following fetch then reports -ENODATA.
+ */
+static void accel_replay_motion_work(struct k_work *work) {
+        struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+        struct accel_replay_data *data =
+                CONTAINER_OF(dwork, struct accel_replay_data, motion_work);
+
+        if (data->motion_handler == NULL) {
+                return;
+        }
+        if (advance(data) < 0 || data->motion || !data->has_next) {
+                data->motion = false;
+                data->slope_count = 0;
+                data->motion_handler(data->dev, data->motion_trigger);
+        }
+        // The handler may have disarmed the trigger
+        if (data->motion_handler != NULL && data->has_next) {
+                k_work_reschedule(dwork,
+                                  K_TIMEOUT_ABS_MS(data->start_ms + data->next.timestamp_ms));
+        }
+}
+
+static int accel_replay_attr_set(const struct device *dev, enum sensor_channel chan,
+                                 enum sensor_attribute attr, const struct sensor_value *val) {
+        struct accel_replay_data *data = dev->data;
+
+        if (chan != SENSOR_CHAN_ACCEL_XYZ) {
+                return -ENOTSUP;
+        }
+
+        switch (attr) {
+        case SENSOR_ATTR_SLOPE_TH:
+                data->slope_th_mm_s2 = (int32_t)sensor_value_to_milli(val);
+                return 0;
+        case SENSOR_ATTR_SLOPE_DUR:
+                if (val->val1 < 1 || val->val1 > UINT8_MAX) {
+                        return -EINVAL;
+                }
+                data->slope_dur = (uint8_t)val->val1;
+                return 0;
+        default:
+                return -ENOTSUP;
+        }
+}
+
+static int accel_replay_trigger_set(const struct device *dev, const struct sensor_trigger *trig,
+                                    sensor_trigger_handler_t handler) {
+        struct accel_replay_data *data = dev->data;
+
+        if (trig->type != SENSOR_TRIG_DELTA) {
+                return -ENOTSUP;
+        }
+
+        data->motion_trigger = trig;
+        data->motion_handler = handler;
+        data->motion = false;
+        data->slope_count = 0;
+        if (handler == NULL) {
+                (void)k_work_cancel_delayable(&data->motion_work);
+                return 0;
+        }
+        k_work_reschedule(&data->motion_work, K_NO_WAIT);
+        return 0;
+}
+
+static int accel_replay_channel_get(const struct device *dev, enum sensor_channel chan,
+                                    struct sensor_value *val) {
+        const struct accel_replay_data *data = dev->data;
+
+        switch (chan) {
+        case SENSOR_CHAN_ACCEL_X:
+                return sensor_value_from_milli(val, data->current.accel[0]);
+        case SENSOR_CHAN_ACCEL_Y:
+                return sensor_value_from_milli(val, data->current.accel[1]);
+        case SENSOR_CHAN_ACCEL_Z:
+                return sensor_value_from_milli(val, data->current.accel[2]);
+        case SENSOR_CHAN_ACCEL_XYZ:
+                for (unsigned i = 0; i < 3; i++) {
+                        (void)sensor_value_from_milli(&val[i], data->current.accel[i]);
+                }
+                return 0;
+        default:
+                return -ENOTSUP;
+        }
+}
+
+static DEVICE_API(sensor, accel_replay_driver_api) = {
+        .attr_set = accel_replay_attr_set,
+        .trigger_set = accel_replay_trigger_set,
+        .sample_fetch = accel_replay_sample_fetch,
+        .channel_get = accel_replay_channel_get,
+};
+
+static int accel_replay_init(const struct device *dev) {
+        struct accel_replay_data *data = dev->data;
+
+        data->dev = dev;
+        data->slope_dur = 1;
+        k_work_init_delayable(&data->motion_work, accel_replay_motion_work);
+
+        if (trace_path == NULL) {
+                LOG_ERR("No trace given, use --accel-trace=<file>");
+                return -ENOENT;
+        }
+        if (accel_replay_bottom_open(trace_path) < 0) {
+                LOG_ERR("Failed to open trace %s", trace_path);
+                return -EIO;
+        }
+
+        int rc = read_row(&data->next);
+        if (rc <= 0) {
+                LOG_ERR("Trace %s is empty", trace_path);
+                return -ENODATA;
+        }
+        data->current = data->next;
+        data->has_next = true;
+        return 0;
+}
+
+static void accel_replay_add_options(void) {
+        static struct args_struct_t options[] = {
+                {
+                        .option = "accel-trace",
+                        .name = "path",
+                        .type = 's',
+                        .dest = (void *)&trace_path,
+                        .descript = "CSV trace (timestamp_ms,x,y,z in mm/s^2) played "
+                                    "back by the accel-replay sensor",
+                },
+                ARG_TABLE_ENDMARKER,
+        };
+
+        native_add_command_line_opts(options);
+}
+
+NATIVE_TASK(accel_replay_add_options, PRE_BOOT_1, 10);
+
+#define ACCEL_REPLAY_DEFINE(inst)                                                          \
+        static struct accel_replay_data accel_replay_data_##inst;                           \
+        SENSOR_DEVICE_DT_INST_DEFINE(inst, accel_replay_init, NULL,                         \
+                &accel_replay_data_##inst, NULL, POST_KERNEL,                               \
+                CONFIG_SENSOR_INIT_PRIORITY, &accel_replay_driver_api);
+
+DT_INST_FOREACH_STATUS_OKAY(ACCEL_REPLAY_DEFINE)
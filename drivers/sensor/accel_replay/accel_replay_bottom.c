@@ -0,0 +1,27 @@
+#include "accel_replay_bottom.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+static FILE *trace;
+
+int accel_replay_bottom_open(const char *path) {
+        trace = fopen(path, "r");
+        return trace == NULL ? -1 : 0;
+}
+
+int accel_replay_bottom_read(int64_t *timestamp_ms, int32_t *x, int32_t *y, int32_t *z) {
+        char line[128];
+
+        if (trace == NULL) {
+                return -1;
+        }
+        while (fgets(line, sizeof(line), trace) != NULL) {
+                // Skips headers, comments and empty lines
+                if (sscanf(line, "%" SCNd64 ",%" SCNd32 ",%" SCNd32 ",%" SCNd32,
+                           timestamp_ms, x, y, z) == 4) {
+                        return 1;
+                }
+        }
+        return ferror(trace) ? -1 : 0;
+}
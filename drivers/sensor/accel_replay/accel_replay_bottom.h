@@ -0,0 +1,14 @@
+#ifndef DRIVERS_SENSOR_ACCEL_REPLAY_ACCEL_REPLAY_BOTTOM_H_
+#define DRIVERS_SENSOR_ACCEL_REPLAY_ACCEL_REPLAY_BOTTOM_H_
+
+#include <stdint.h>
+
+/* Host side of the replay driver, only plain C types cross this boundary. */
+
+int accel_replay_bottom_open(const char *path);
+
+/* Reads the next "timestamp_ms,x,y,z" row, acceleration in mm/s^2.
+ * Returns 1 on success, 0 at end of file, -1 on error. */
+int accel_replay_bottom_read(int64_t *timestamp_ms, int32_t *x, int32_t *y, int32_t *z);
+
+#endif /* DRIVERS_SENSOR_ACCEL_REPLAY_ACCEL_REPLAY_BOTTOM_H_ */
@@ -4,17 +4,26 @@
 #include "qmc5883l.h"
 #include <zephyr/drivers/i2c.h>
 #include <zephyr/drivers/sensor.h>
+#include <zephyr/pm/device.h>
 
 #include <zephyr/logging/log.h>
 
 LOG_MODULE_REGISTER(HMC5883L, CONFIG_SENSOR_LOG_LEVEL);
 
-static int qmc5883_update_config(const struct device *dev) {
+/* Mode the chip idles in while the device is active */
+#ifdef CONFIG_QMC5883L_ON_DEMAND
+#define QMC5883_MODE_ACTIVE QMC5883_MODE_STANDBY
+#else
+#define QMC5883_MODE_ACTIVE QMC5883_MODE_CONTINUOUS
+#endif
+
+static int qmc5883_update_config(const struct device *dev, uint8_t mode) {
         const struct qmc5883_config *config = dev->config;
+        const struct qmc5883_data *data = dev->data;
 
         uint8_t sampling_frequency = UINT8_MAX;
         for (uint8_t i = 0; i < ARRAY_SIZE(qmc5883_data_rate_values); i++) {
-                if (qmc5883_data_rate_values[i] == config->data_rate) {
+                if (qmc5883_data_rate_values[i] == data->data_rate) {
                         sampling_frequency = i;
                         break;
                 }
@@ -22,7 +31,7 @@ static int qmc5883_update_config(const struct device *dev) {
 
         uint8_t magnetic_range = UINT8_MAX;
         for (uint8_t i = 0; i < ARRAY_SIZE(qmc5883_range_values); i++) {
-                if (qmc5883_range_values[i] == config->magnetic_range) {
+                if (qmc5883_range_values[i] == data->magnetic_range) {
                         magnetic_range = i;
                         break;
                 }
@@ -30,7 +39,7 @@ static int qmc5883_update_config(const struct device *dev) {
 
         uint8_t oversampling = UINT8_MAX;
         for (uint8_t i = 0; i < ARRAY_SIZE(qmc5883_oversampling_values); i++) {
-                if (qmc5883_oversampling_values[i] == config->oversampling) {
+                if (qmc5883_oversampling_values[i] == data->oversampling) {
                         oversampling = i;
                         break;
                 }
@@ -44,7 +53,7 @@ static int qmc5883_update_config(const struct device *dev) {
         uint8_t config_value = (sampling_frequency << QMC5883_DATA_RATE_SHIFT) |
                                (magnetic_range << QMC5883_RANGE_SHIFT) |
                                (oversampling << QMC5883_OVERSAMPLING_SHIFT) |
-                               (QMC5883_MODE_CONTINUOUS);
+                               (mode & QMC5883_MODE_MASK);
 
         if (i2c_reg_write_byte_dt(&config->i2c, QMC5883_CONTROL_REGISTER_1,
                                   config_value) < 0) {
@@ -54,24 +63,86 @@ static int qmc5883_update_config(const struct device *dev) {
         return 0;
 }
 
+#ifdef CONFIG_QMC5883L_ON_DEMAND
+/* Run the chip for one conversion and wait for it to flag data ready */
+static int qmc5883_measure(const struct device *dev) {
+        const struct qmc5883_config *config = dev->config;
+        const struct qmc5883_data *data = dev->data;
+
+        int ret = qmc5883_update_config(dev, QMC5883_MODE_CONTINUOUS);
+        if (ret < 0) {
+                return ret;
+        }
+
+        /* Data shows up one output period after leaving standby */
+        int64_t deadline = k_uptime_get() + 2 * (1000 / data->data_rate) +
+                           CONFIG_QMC5883L_ON_DEMAND_MARGIN_MS;
+        uint8_t status = 0;
+
+        do {
+                k_sleep(K_MSEC(1));
+                if (i2c_reg_read_byte_dt(&config->i2c, QMC5883_STATUS_REGISTER,
+                                         &status) < 0) {
+                        LOG_ERR("Failed to read status.");
+                        return -EIO;
+                }
+        } while (!(status & QMC5883_STATUS_DATA_READY) &&
+                 k_uptime_get() < deadline);
+
+        if (!(status & QMC5883_STATUS_DATA_READY)) {
+                LOG_ERR("Measurement timed out.");
+                return -ETIMEDOUT;
+        }
+        return 0;
+}
+#endif
+
 static int qmc5883_sample_fetch(const struct device *dev,
                                  enum sensor_channel chan) {
         struct qmc5883_data *data = dev->data;
         const struct qmc5883_config *config = dev->config;
+        int ret = 0;
 
 	__ASSERT_NO_MSG(chan == SENSOR_CHAN_ALL);
 
         uint8_t buf[6];
+#ifdef CONFIG_QMC5883L_ON_DEMAND
+        ret = qmc5883_measure(dev);
+        if (ret == 0 &&
+            i2c_burst_read_dt(&config->i2c, QMC5883_XYZ_DATA_START, buf, 6) < 0) {
+                LOG_ERR("Failed to fetch sample.");
+                ret = -EIO;
+        }
+
+        /* Back to standby whatever happened above */
+        if (qmc5883_update_config(dev, QMC5883_MODE_STANDBY) < 0 && ret == 0) {
+                ret = -EIO;
+        }
+        if (ret < 0) {
+                return ret;
+        }
+#else
+#ifdef CONFIG_PM_DEVICE
+        enum pm_device_state state;
+
+        /* A suspended chip sits in standby, its data registers are stale */
+        (void)pm_device_state_get(dev, &state);
+        if (state != PM_DEVICE_STATE_ACTIVE) {
+                return -EBUSY;
+        }
+#endif
+
         if (i2c_burst_read_dt(&config->i2c, QMC5883_XYZ_DATA_START, buf, 6) < 0) {
                 LOG_ERR("Failed to fetch sample.");
                 return -EIO;
         }
+#endif
 
         data->x_sample = (int16_t)((buf[1] << 8) | buf[0]);
         data->y_sample = (int16_t)((buf[3] << 8) | buf[2]);
         data->z_sample = (int16_t)((buf[5] << 8) | buf[4]);
 
-        return 0;
+        return ret;
 }
 
 static int qmc5883_channel_get(const struct device *dev,
@@ -100,13 +171,119 @@ static int qmc5883_channel_get(const struct device *dev,
         return 0;
 }
 
+static int qmc5883_attr_set(const struct device *dev,
+                            enum sensor_channel chan,
+                            enum sensor_attribute attr,
+                            const struct sensor_value *val) {
+        struct qmc5883_data *data = dev->data;
+        bool valid = false;
+
+        if (chan != SENSOR_CHAN_ALL && chan != SENSOR_CHAN_MAGN_XYZ &&
+            chan != SENSOR_CHAN_MAGN_X && chan != SENSOR_CHAN_MAGN_Y &&
+            chan != SENSOR_CHAN_MAGN_Z) {
+                return -ENOTSUP;
+        }
+
+        /* Settings are shared by all axes, only whole numbers are accepted */
+        if (val->val2 != 0) {
+                return -EINVAL;
+        }
+
+        uint8_t data_rate = data->data_rate;
+        uint8_t magnetic_range = data->magnetic_range;
+        uint16_t oversampling = data->oversampling;
+
+        switch (attr) {
+        case SENSOR_ATTR_SAMPLING_FREQUENCY:
+                for (uint8_t i = 0; i < ARRAY_SIZE(qmc5883_data_rate_values); i++) {
+                        if (qmc5883_data_rate_values[i] == val->val1) {
+                                data_rate = val->val1;
+                                valid = true;
+                                break;
+                        }
+                }
+                break;
+        case SENSOR_ATTR_FULL_SCALE:
+                for (uint8_t i = 0; i < ARRAY_SIZE(qmc5883_range_values); i++) {
+                        if (qmc5883_range_values[i] == val->val1) {
+                                magnetic_range = val->val1;
+                                valid = true;
+                                break;
+                        }
+                }
+                break;
+        case SENSOR_ATTR_OVERSAMPLING:
+                for (uint8_t i = 0; i < ARRAY_SIZE(qmc5883_oversampling_values); i++) {
+                        if (qmc5883_oversampling_values[i] == val->val1) {
+                                oversampling = val->val1;
+                                valid = true;
+                                break;
+                        }
+                }
+                break;
+        default:
+                return -ENOTSUP;
+        }
+
+        if (!valid) {
+                return -EINVAL;
+        }
+
+        uint8_t old_data_rate = data->data_rate;
+        uint8_t old_magnetic_range = data->magnetic_range;
+        uint16_t old_oversampling = data->oversampling;
+
+        data->data_rate = data_rate;
+        data->magnetic_range = magnetic_range;
+        data->oversampling = oversampling;
+
+#ifdef CONFIG_PM_DEVICE
+        enum pm_device_state state;
+
+        /* Applied on resume, keep a suspended chip in standby */
+        if (pm_device_state_get(dev, &state) == 0 &&
+            state != PM_DEVICE_STATE_ACTIVE) {
+                return 0;
+        }
+#endif
+
+        int ret = qmc5883_update_config(dev, QMC5883_MODE_ACTIVE);
+        if (ret < 0) {
+                data->data_rate = old_data_rate;
+                data->magnetic_range = old_magnetic_range;
+                data->oversampling = old_oversampling;
+        }
+        return ret;
+}
+
 static DEVICE_API(sensor, qmc5883_driver_api) = {
+        .attr_set = qmc5883_attr_set,
+#ifdef CONFIG_QMC5883L_TRIGGER
+        .trigger_set = qmc5883_trigger_set,
+#endif
         .sample_fetch = qmc5883_sample_fetch,
         .channel_get = qmc5883_channel_get,
 };
 
+static int qmc5883_pm_action(const struct device *dev,
+                             enum pm_device_action action) {
+        switch (action) {
+        case PM_DEVICE_ACTION_RESUME:
+                return qmc5883_update_config(dev, QMC5883_MODE_ACTIVE);
+        case PM_DEVICE_ACTION_SUSPEND:
+                return qmc5883_update_config(dev, QMC5883_MODE_STANDBY);
+        default:
+                return -ENOTSUP;
+        }
+}
+
 int qmc5883_init(const struct device *dev) {
         const struct qmc5883_config *config = dev->config;
+        struct qmc5883_data *data = dev->data;
+
+        data->data_rate = config->data_rate;
+        data->magnetic_range = config->magnetic_range;
+        data->oversampling = config->oversampling;
 
         if (!device_is_ready(config->i2c.bus)) {
                 LOG_ERR("I2C bus device not ready");
@@ -139,7 +316,24 @@ int qmc5883_init(const struct device *dev) {
                 return -EIO;
         }
 
-        if (qmc5883_update_config(dev) < 0) {
+        /* Keep DRDY masked until a trigger handler is installed */
+        if (i2c_reg_write_byte_dt(&config->i2c, QMC5883_CONTROL_REGISTER_2,
+                                  QMC5883_INTERRUPT_ENABLE) < 0) {
+                LOG_ERR("Failed to mask interrupt.");
+                return -EIO;
+        }
+
+#ifdef CONFIG_QMC5883L_TRIGGER
+        if (config->drdy_gpio.port != NULL) {
+                if (qmc5883_init_interrupt(dev) < 0) {
+                        LOG_ERR("Failed to initialize interrupt.");
+                        return -EIO;
+                }
+        }
+#endif
+
+        /* The reset left the chip in standby, resume starts measuring */
+        if (pm_device_driver_init(dev, qmc5883_pm_action) < 0) {
                 LOG_ERR("Failed to update configuration.");
                 return -EIO;
         }
@@ -148,13 +342,17 @@ int qmc5883_init(const struct device *dev) {
 
 #define QMC5883_DEFINE(inst)                                                        \
         static struct qmc5883_data qmc5883_data_##inst;                               \
-        static struct qmc5883_config qmc5883_config_##inst = {                  \
+        static const struct qmc5883_config qmc5883_config_##inst = {            \
                 .i2c = I2C_DT_SPEC_INST_GET(inst),                                   \
                 .data_rate = DT_INST_PROP(inst, sampling_frequency),            \
                 .magnetic_range = DT_INST_PROP(inst, magnetic_field_range), \
                 .oversampling = DT_INST_PROP(inst, oversampling),                   \
+                IF_ENABLED(CONFIG_QMC5883L_TRIGGER,                                 \
+                           (.drdy_gpio = GPIO_DT_SPEC_INST_GET_OR(inst, drdy_gpios, {0}),)) \
         };\
-        SENSOR_DEVICE_DT_INST_DEFINE(inst, qmc5883_init, NULL,\
+        PM_DEVICE_DT_INST_DEFINE(inst, qmc5883_pm_action);                        \
+        SENSOR_DEVICE_DT_INST_DEFINE(inst, qmc5883_init,                            \
+                PM_DEVICE_DT_INST_GET(inst),                                        \
                 &qmc5883_data_##inst, &qmc5883_config_##inst, POST_KERNEL, \
                 CONFIG_SENSOR_INIT_PRIORITY, &qmc5883_driver_api); 
 
@@ -2,7 +2,9 @@
 #define DRIVERS_SENSOR_QMC5883L_QMC5883L_H_
 
 #include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
 #include <zephyr/drivers/i2c.h>
+#include <zephyr/drivers/sensor.h>
 
 #define QMC5883_XYZ_DATA_START 0x00u
 
@@ -29,6 +31,7 @@ const static uint8_t qmc5883_range_values[] = {2, 8};
 const static uint16_t qmc5883_oversampling_values[] = {512, 256, 128, 64};
 
 #define QMC5883_CONTROL_REGISTER_2 0x0Au
+/* INT_ENB: despite the name, setting it masks the DRDY pin */
 #define QMC5883_INTERRUPT_ENABLE BIT(0u)
 #define QMC5883_ROLL_POINTER BIT(6u)
 #define QMC5883_SOFT_RESET BIT(7u)
@@ -44,12 +47,44 @@ struct qmc5883_data {
         int16_t y_sample;
         int16_t z_sample;
         int16_t temperature;
+
+        /* Current settings, start out from devicetree */
+        uint8_t data_rate;
+        uint8_t magnetic_range;
+        uint16_t oversampling;
+
+#ifdef CONFIG_QMC5883L_TRIGGER
+        const struct device *dev;
+        struct gpio_callback gpio_cb;
+
+        const struct sensor_trigger *drdy_trigger;
+        sensor_trigger_handler_t drdy_handler;
+
+#if defined(CONFIG_QMC5883L_TRIGGER_OWN_THREAD)
+        K_KERNEL_STACK_MEMBER(thread_stack, CONFIG_QMC5883L_THREAD_STACK_SIZE);
+        struct k_thread thread;
+        struct k_sem gpio_sem;
+#elif defined(CONFIG_QMC5883L_TRIGGER_GLOBAL_THREAD)
+        struct k_work work;
+#endif
+#endif /* CONFIG_QMC5883L_TRIGGER */
 };
 struct qmc5883_config {
         struct i2c_dt_spec i2c;
         uint8_t data_rate;
         uint8_t magnetic_range;
         uint16_t oversampling;
+#ifdef CONFIG_QMC5883L_TRIGGER
+        struct gpio_dt_spec drdy_gpio;
+#endif
 };
 
+#ifdef CONFIG_QMC5883L_TRIGGER
+int qmc5883_trigger_set(const struct device *dev,
+                        const struct sensor_trigger *trig,
+                        sensor_trigger_handler_t handler);
+
+int qmc5883_init_interrupt(const struct device *dev);
+#endif
+
 #endif /* DRIVERS_SENSOR_QMC5883L_QMC5883L_H_ */
@@ -0,0 +1,162 @@
+#define DT_DRV_COMPAT qst_qmc5883l
+
+#include "qmc5883l.h"
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/i2c.h>
+#include <zephyr/drivers/sensor.h>
+#include <zephyr/kernel.h>
+
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_DECLARE(HMC5883L, CONFIG_SENSOR_LOG_LEVEL);
+
+static void qmc5883_gpio_callback(const struct device *port,
+                                  struct gpio_callback *cb, uint32_t pins) {
+        struct qmc5883_data *data =
+                CONTAINER_OF(cb, struct qmc5883_data, gpio_cb);
+        const struct qmc5883_config *config = data->dev->config;
+
+        ARG_UNUSED(port);
+        ARG_UNUSED(pins);
+
+        gpio_pin_interrupt_configure_dt(&config->drdy_gpio, GPIO_INT_DISABLE);
+
+#if defined(CONFIG_QMC5883L_TRIGGER_OWN_THREAD)
+        k_sem_give(&data->gpio_sem);
+#elif defined(CONFIG_QMC5883L_TRIGGER_GLOBAL_THREAD)
+        k_work_submit(&data->work);
+#endif
+}
+
+static void qmc5883_thread_cb(const struct device *dev) {
+        struct qmc5883_data *data = dev->data;
+        const struct qmc5883_config *config = dev->config;
+
+        if (data->drdy_handler == NULL) {
+                return;
+        }
+
+        data->drdy_handler(dev, data->drdy_trigger);
+
+        gpio_pin_interrupt_configure_dt(&config->drdy_gpio,
+                                        GPIO_INT_EDGE_TO_ACTIVE);
+
+        /*
+         * DRDY only drops once the data registers are read. If the handler
+         * did not fetch, or a new sample landed meanwhile, the pin stays
+         * high and no further edge would arrive; read the data to clear it.
+         */
+        if (gpio_pin_get_dt(&config->drdy_gpio) > 0) {
+                uint8_t buf[6];
+
+                if (i2c_burst_read_dt(&config->i2c, QMC5883_XYZ_DATA_START,
+                                      buf, sizeof(buf)) < 0) {
+                        LOG_ERR("Failed to clear data ready.");
+                }
+        }
+}
+
+#ifdef CONFIG_QMC5883L_TRIGGER_OWN_THREAD
+static void qmc5883_thread(void *p1, void *p2, void *p3) {
+        struct qmc5883_data *data = p1;
+
+        ARG_UNUSED(p2);
+        ARG_UNUSED(p3);
+
+        while (1) {
+                k_sem_take(&data->gpio_sem, K_FOREVER);
+                qmc5883_thread_cb(data->dev);
+        }
+}
+#endif
+
+#ifdef CONFIG_QMC5883L_TRIGGER_GLOBAL_THREAD
+static void qmc5883_work_cb(struct k_work *work) {
+        struct qmc5883_data *data =
+                CONTAINER_OF(work, struct qmc5883_data, work);
+
+        qmc5883_thread_cb(data->dev);
+}
+#endif
+
+int qmc5883_trigger_set(const struct device *dev,
+                        const struct sensor_trigger *trig,
+                        sensor_trigger_handler_t handler) {
+        struct qmc5883_data *data = dev->data;
+        const struct qmc5883_config *config = dev->config;
+
+        if (config->drdy_gpio.port == NULL) {
+                return -ENOTSUP;
+        }
+
+        if (trig->type != SENSOR_TRIG_DATA_READY) {
+                return -ENOTSUP;
+        }
+
+        gpio_pin_interrupt_configure_dt(&config->drdy_gpio, GPIO_INT_DISABLE);
+
+        data->drdy_handler = handler;
+        data->drdy_trigger = trig;
+
+        uint8_t control = handler != NULL ? 0 : QMC5883_INTERRUPT_ENABLE;
+        if (i2c_reg_write_byte_dt(&config->i2c, QMC5883_CONTROL_REGISTER_2,
+                                  control) < 0) {
+                LOG_ERR("Failed to configure interrupt.");
+                return -EIO;
+        }
+
+        if (handler == NULL) {
+                return 0;
+        }
+
+        gpio_pin_interrupt_configure_dt(&config->drdy_gpio,
+                                        GPIO_INT_EDGE_TO_ACTIVE);
+
+        /* A sample may already be pending, run the handler for it */
+        if (gpio_pin_get_dt(&config->drdy_gpio) > 0) {
+                qmc5883_gpio_callback(config->drdy_gpio.port, &data->gpio_cb,
+                                      BIT(config->drdy_gpio.pin));
+        }
+
+        return 0;
+}
+
+int qmc5883_init_interrupt(const struct device *dev) {
+        struct qmc5883_data *data = dev->data;
+        const struct qmc5883_config *config = dev->config;
+
+        if (!gpio_is_ready_dt(&config->drdy_gpio)) {
+                LOG_ERR("GPIO device not ready");
+                return -ENODEV;
+        }
+
+        data->dev = dev;
+
+        if (gpio_pin_configure_dt(&config->drdy_gpio, GPIO_INPUT) < 0) {
+                LOG_ERR("Failed to configure DRDY pin.");
+                return -EIO;
+        }
+
+        gpio_init_callback(&data->gpio_cb, qmc5883_gpio_callback,
+                           BIT(config->drdy_gpio.pin));
+
+        if (gpio_add_callback(config->drdy_gpio.port, &data->gpio_cb) < 0) {
+                LOG_ERR("Failed to set GPIO callback.");
+                return -EIO;
+        }
+
+#if defined(CONFIG_QMC5883L_TRIGGER_OWN_THREAD)
+        k_sem_init(&data->gpio_sem, 0, K_SEM_MAX_LIMIT);
+
+        k_thread_create(&data->thread, data->thread_stack,
+                        CONFIG_QMC5883L_THREAD_STACK_SIZE, qmc5883_thread,
+                        data, NULL, NULL,
+                        K_PRIO_COOP(CONFIG_QMC5883L_THREAD_PRIORITY), 0,
+                        K_NO_WAIT);
+        k_thread_name_set(&data->thread, "qmc5883l");
+#elif defined(CONFIG_QMC5883L_TRIGGER_GLOBAL_THREAD)
+        k_work_init(&data->work, qmc5883_work_cb);
+#endif
+
+        return 0;
+}
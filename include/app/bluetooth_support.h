@@ -2,7 +2,21 @@
 
 #include "posture_detection.h"
 
+#ifdef CONFIG_BT
+
 void bluetooth_support_notify_posture(void);
 void bluetooth_support_notify_movement(void);
 void bluetooth_support_notify_state(enum posture_state state);
-void bluetooth_remove_bonded_peer(void);
\ No newline at end of file
+void bluetooth_remove_bonded_peer(void);
+/* Restart the advertising backoff from its fast phase */
+void bluetooth_support_wake_advertising(void);
+
+#else
+
+static inline void bluetooth_support_notify_posture(void) {}
+static inline void bluetooth_support_notify_movement(void) {}
+static inline void bluetooth_support_notify_state(enum posture_state state) { (void)state; }
+static inline void bluetooth_remove_bonded_peer(void) {}
+static inline void bluetooth_support_wake_advertising(void) {}
+
+#endif
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Register level BMI160 features the Zephyr driver doesn't expose. */
+
+struct bmi160_fifo_sample {
+    /* Acceleration, same 1/1000 m/s^2 units as sensor_processing */
+    int16_t x;
+    int16_t y;
+    int16_t z;
+    /* Angular rate in mdeg/s, zero unless the FIFO runs with gyro */
+    int32_t gyro_x;
+    int32_t gyro_y;
+    int32_t gyro_z;
+};
+
+int bmi160_fifo_start(bool with_gyro);
+int bmi160_fifo_stop(void);
+
+/* Drains up to max_samples frames. Returns number of frames read or negative
+ * errno. */
+int bmi160_fifo_read(struct bmi160_fifo_sample *samples, size_t max_samples);
+
+/* Time between two FIFO frames, derived from the configured accelerometer
+ * ODR. Valid after bmi160_fifo_start(). */
+uint32_t bmi160_fifo_frame_period_us(void);
+
+/* Time the gyroscope needs after leaving suspend before its data is valid */
+#define BMI160_GYRO_STARTUP_MS 80
+
+/* Switches the gyroscope between normal and suspend power mode. Returns
+ * right away, gyro data is only valid BMI160_GYRO_STARTUP_MS later. The
+ * driver doesn't notice, so no sensor_sample_fetch() may run while it is
+ * suspended: it would wait for gyroscope data ready forever. */
+int bmi160_gyro_set_power(bool enabled);
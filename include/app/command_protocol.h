@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * NUS command protocol. One write carries one or more commands:
+ *
+ *   [opcode u8][length u8][payload, length bytes]
+ *
+ * Every command is answered with
+ *
+ *   [opcode | CMD_RESPONSE_FLAG][status u8][payload]
+ *
+ * Multi-byte values are little endian. Asynchronous notifications and bulk
+ * transfer data keep their own markers.
+ */
+
+enum cmd_opcode {
+	CMD_GET_STATE = 0x01,	     /* -> state u8 */
+	CMD_GET_SETTINGS = 0x02,     /* -> struct posture_settings */
+	CMD_SET_TIMEOUT = 0x03,	     /* seconds u8 -> struct posture_settings */
+	CMD_SET_ENABLED = 0x04,	     /* 0/1 u8 -> struct posture_settings */
+	CMD_SET_RANGE = 0x05,	     /* degrees u8 -> struct posture_settings */
+	CMD_CALIBRATE = 0x06,	     /* -> struct posture_settings */
+	CMD_GET_LINK = 0x07,	     /* -> idle s u32, fast s u32, interval u16, latency u16 */
+	CMD_GET_POWER_STATS = 0x08,  /* id u8 -> id u8, count u32, cpu us u32, uptime ms u32 */
+	CMD_GET_LATENCY = 0x09,	     /* stage u8, bucket u8 -> stage u8, bucket u8, 3 x count u32 */
+	CMD_GET_QUEUE_STATS = 0x0A,  /* -> telemetry dropped u32, queued max u32,
+				      * posture coalesced u32, backlog max u32 */
+	CMD_TELEMETRY_DUMP = 0x10,   /* streams all records, then "TD" */
+	CMD_TELEMETRY_SYNC = 0x11,   /* streams records after the cursor, then "SD" */
+	CMD_TELEMETRY_ACK = 0x12,    /* seq u32 -> cursor u32 */
+	CMD_RECORD_START = 0x20,     /* -> recording u8, busy while a dump runs */
+	CMD_RECORD_STOP = 0x21,	     /* -> recording u8 */
+	CMD_RECORD_DUMP = 0x22,	     /* streams the trace, then "RD", busy while recording */
+	CMD_OPCODE_COUNT,
+};
+
+enum cmd_status {
+	CMD_STATUS_OK = 0,
+	CMD_STATUS_UNKNOWN_OPCODE = 1,
+	CMD_STATUS_BAD_LENGTH = 2,
+	CMD_STATUS_BAD_VALUE = 3,
+	CMD_STATUS_BUSY = 4,
+	CMD_STATUS_FAILED = 5,
+	/* Frame header or payload runs past the end of the write */
+	CMD_STATUS_MALFORMED = 6,
+};
+
+#define CMD_RESPONSE_FLAG 0x80
+#define CMD_RESPONSE_PAYLOAD_MAX 16
+
+struct cmd_response {
+	uint8_t len;
+	uint8_t payload[CMD_RESPONSE_PAYLOAD_MAX];
+};
+
+typedef enum cmd_status (*cmd_handler_t)(const uint8_t *payload, uint8_t len,
+					 struct cmd_response *rsp);
+
+struct cmd_def {
+	cmd_handler_t handler;
+	uint8_t min_len;
+	uint8_t max_len;
+};
+
+typedef void (*cmd_reply_t)(const uint8_t *buf, size_t len);
+
+/**
+ * Validate and dispatch every command in data through table, which is
+ * indexed by opcode. Each command gets a reply. Returns the number of
+ * commands handled, or -EBADMSG if the write ended in a truncated frame.
+ */
+int command_protocol_process(const struct cmd_def *table, size_t table_len, const uint8_t *data,
+			     size_t len, cmd_reply_t reply);
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/slist.h>
+
+/*
+ * One timer for all of the app's periodic and timeout work: sensor sampling,
+ * the vibration stop and the posture deadlines while sampling is parked.
+ * Each client owns a struct deadline. The scheduler arms a single delayable
+ * work item for the earliest armed deadline and runs the due handlers from
+ * the system workqueue, so nothing wakes the CPU between deadlines.
+ */
+
+struct deadline;
+
+typedef void (*deadline_handler_t)(struct deadline *deadline);
+
+struct deadline {
+	sys_snode_t node;
+	deadline_handler_t handler;
+	/* Absolute uptime in ticks */
+	int64_t at;
+	/* Scheduler pass the deadline was armed in, it runs in a later one */
+	uint32_t pass;
+	bool armed;
+};
+
+#define DEADLINE_INITIALIZER(_handler) {.handler = (_handler)}
+
+#define DEADLINE_DEFINE(name, _handler) struct deadline name = DEADLINE_INITIALIZER(_handler)
+
+/* Only for deadlines that aren't armed */
+static inline void deadline_init(struct deadline *deadline, deadline_handler_t handler) {
+	*deadline = (struct deadline)DEADLINE_INITIALIZER(handler);
+}
+
+/* Arm or re-arm the deadline delay_ms from now */
+void deadline_arm(struct deadline *deadline, uint32_t delay_ms);
+
+/* Returns true if the deadline is armed and its handler hasn't started */
+bool deadline_is_armed(struct deadline *deadline);
+
+/* Returns true if the deadline was armed */
+bool deadline_cancel(struct deadline *deadline);
+
+/* Like deadline_cancel(), but also waits for a running handler to return, so
+ * it can't re-arm itself afterwards. */
+bool deadline_cancel_sync(struct deadline *deadline);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+
+/* atan2(y, x) in degrees, Q16.16. Matches atan2f within ~0.01 deg. */
+int32_t fixed_atan2_q16(int32_t y, int32_t x);
+
+/* atan2(y, x) in whole degrees, truncated towards zero like a float cast. */
+static inline int16_t fixed_atan2_deg(int32_t y, int32_t x) {
+    return (int16_t)(fixed_atan2_q16(y, x) / 65536);
+}
+
+/* floor(sqrt(value)) */
+uint16_t fixed_isqrt(uint32_t value);
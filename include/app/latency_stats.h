@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <zephyr/kernel.h>
+
+/*
+ * Latency of the posture pipeline, from the sensor fetch of a sample to the
+ * alert it triggers. Timestamps are kernel cycles (k_cycle_get_32(), the
+ * 32 kHz RTC on nRF) carried in posture_data. Each stage keeps a histogram
+ * with power of two buckets in microseconds: bucket 0 holds 0 us, bucket b
+ * holds [2^(b-1), 2^b) us and the last bucket everything longer.
+ */
+
+enum latency_stage {
+	/* sensor fetch -> posture_data published */
+	LATENCY_STAGE_WINDOW,
+	/* posture_data published -> picked up by posture detection */
+	LATENCY_STAGE_QUEUE,
+	/* detection -> vibration and BLE alert issued */
+	LATENCY_STAGE_ACTION,
+	/* sensor fetch -> vibration and BLE alert issued */
+	LATENCY_STAGE_TOTAL,
+	/* sensor read started -> data available */
+	LATENCY_STAGE_SENSOR_READ,
+	/* Part of the sensor read the system workqueue waited for */
+	LATENCY_STAGE_SENSOR_BLOCKED,
+	LATENCY_STAGE_COUNT,
+};
+
+#define LATENCY_HIST_BUCKETS 20
+
+#ifdef CONFIG_APP_LATENCY_STATS
+
+static inline uint32_t latency_stats_now(void) {
+	return k_cycle_get_32();
+}
+
+void latency_stats_record(enum latency_stage stage, uint32_t start, uint32_t end);
+/* Copies up to max buckets starting at first, returns how many were copied */
+int latency_stats_get(enum latency_stage stage, unsigned first, uint32_t *counts, unsigned max);
+
+#else
+
+static inline uint32_t latency_stats_now(void) { return 0; }
+static inline void latency_stats_record(enum latency_stage stage, uint32_t start, uint32_t end) {
+	(void)stage;
+	(void)start;
+	(void)end;
+}
+
+#endif
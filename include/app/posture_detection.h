@@ -7,6 +7,12 @@ struct posture_data {
     int16_t x_angle;
     int16_t y_angle;
     unsigned cm_s2_max_accel_diff;
+    /* Angles come from gyro fusion and stay valid during light movement */
+    bool angles_fused;
+    /* Cycle stamps of the newest sample's fetch and of the window publish,
+     * see latency_stats.h. Zero without CONFIG_APP_LATENCY_STATS. */
+    uint32_t fetch_cyc;
+    uint32_t window_cyc;
 };
 
 struct posture_settings {
@@ -23,8 +29,24 @@ enum posture_state {
     POSTURE_STATE_INCORRECT,
 };
 
+struct posture_queue_stats {
+    /* Updates merged into a pending one because process_data fell behind.
+     * The merged update keeps the latest angles and the larger movement. */
+    uint32_t coalesced;
+    /* Most updates waiting for process_data at once. */
+    uint32_t backlog_max;
+};
+
+/* Queue an update for process_data. Only sensor_processing may call this. */
 void posture_detection_update(struct posture_data *data);
 
+void posture_detection_get_queue_stats(struct posture_queue_stats *stats);
+
+/* Called when sensor sampling is parked. Time based notifications and
+ * telemetry keep running until posture_detection_resume(). */
+void posture_detection_suspend(void);
+void posture_detection_resume(void);
+
 enum posture_state posture_detection_get_state(void);
 
 void posture_detection_do_calibration(void);
@@ -32,4 +54,7 @@ void posture_detection_set_timeout(uint8_t timeout);
 void posture_detection_set_enabled(bool enabled);
 void posture_detection_set_working_range(uint8_t range);
 struct posture_settings posture_detection_get_settings(void);
+/* Settings are persisted shortly after the last change, coalescing bursts */
 void posture_detection_save_settings(void);
+/* Write pending settings changes now, e.g. before power-off */
+void posture_detection_flush_settings(void);
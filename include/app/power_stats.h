@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <zephyr/kernel.h>
+
+/*
+ * Wakeup and CPU time accounting per subsystem. Work handlers are wrapped
+ * with POWER_STATS_HANDLER_DEFINE(), deadline handlers with
+ * POWER_STATS_DEADLINE_DEFINE(), and bound through POWER_STATS_HANDLER(),
+ * plain events are counted with power_stats_count(). The DECLARE/DEFINE
+ * macros carry their own terminator and take no trailing ';'. With
+ * CONFIG_APP_POWER_STATS disabled all of it compiles to nothing.
+ */
+
+struct deadline;
+
+enum power_stats_id {
+	/* Work handlers: runs and CPU time */
+	POWER_STATS_SENSOR,
+	POWER_STATS_POSTURE,
+	POWER_STATS_TELEMETRY,
+	POWER_STATS_TRANSFER,
+	POWER_STATS_ADVERTISING,
+	POWER_STATS_VIBRATION,
+	/* Event counters */
+	POWER_STATS_BT_TX,
+	POWER_STATS_BT_RX,
+	POWER_STATS_FLASH_WRITE,
+	POWER_STATS_FLASH_ERASE,
+	POWER_STATS_COUNT,
+};
+
+struct power_stats_entry {
+	uint32_t count;
+	uint32_t time_us;
+};
+
+#ifdef CONFIG_APP_POWER_STATS
+
+uint32_t power_stats_begin(void);
+void power_stats_end(enum power_stats_id id, uint32_t start);
+void power_stats_count(enum power_stats_id id);
+int power_stats_get(enum power_stats_id id, struct power_stats_entry *entry);
+const char *power_stats_name(enum power_stats_id id);
+
+#define POWER_STATS_HANDLER(handler) handler##_accounted
+
+#define POWER_STATS_HANDLER_DECLARE(handler) static void handler##_accounted(struct k_work *work);
+
+#define POWER_STATS_WRAPPER_DEFINE(id, handler, arg_type)                                          \
+	static void handler##_accounted(arg_type *arg) {                                           \
+		uint32_t start = power_stats_begin();                                              \
+		handler(arg);                                                                      \
+		power_stats_end(id, start);                                                        \
+	}
+
+#define POWER_STATS_HANDLER_DEFINE(id, handler) POWER_STATS_WRAPPER_DEFINE(id, handler, struct k_work)
+
+#define POWER_STATS_DEADLINE_DEFINE(id, handler)                                                   \
+	POWER_STATS_WRAPPER_DEFINE(id, handler, struct deadline)
+
+#else
+
+static inline void power_stats_count(enum power_stats_id id) { (void)id; }
+
+#define POWER_STATS_HANDLER(handler) handler
+#define POWER_STATS_HANDLER_DECLARE(handler)
+#define POWER_STATS_HANDLER_DEFINE(id, handler)
+#define POWER_STATS_DEADLINE_DEFINE(id, handler)
+
+#endif
@@ -12,6 +12,42 @@ struct telemetry {
     uint16_t seconds_in_good_posture;
 };
 
+struct telemetry_storage_stats {
+    /* Records lost because the submission queue was full. */
+    uint32_t dropped;
+    /* Highest number of records waiting for the writer at once. */
+    uint32_t queued_max;
+};
+
+/** Queue a record for storage. Only posture_detection may call this. */
 void telemetry_storage_submit(struct telemetry *telemetry);
 
+void telemetry_storage_get_stats(struct telemetry_storage_stats *stats);
+
+/**
+ * Write the records buffered in RAM and a pending sync cursor to flash.
+ * Call it before the supply goes away: power-off, low battery.
+ */
+int telemetry_storage_flush(void);
+
 int telemetry_get_portion(uint8_t *buf, size_t* len);
+
+/* Sync records are the LE u32 sequence number followed by struct telemetry. */
+#define TELEMETRY_SYNC_RECORD_SIZE (sizeof(uint32_t) + sizeof(struct telemetry))
+
+/**
+ * Like telemetry_get_portion() but only returns records newer than the
+ * acknowledged cursor, each prefixed with its sequence number. Passing a
+ * NULL len restarts the sync.
+ */
+int telemetry_get_sync_portion(uint8_t *buf, size_t *len);
+
+/** Move the sync cursor to seq, it is persisted after a short delay. */
+int telemetry_storage_ack(uint32_t seq);
+uint32_t telemetry_storage_get_cursor(void);
+
+/**
+ * Flush and count the records stored since boot that read back intact.
+ * Shares the reader with the transfers, for the trace replay summary.
+ */
+int telemetry_storage_count_since_boot(void);
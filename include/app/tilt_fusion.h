@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Complementary filter fusing gyroscope rate into the accelerometer tilt.
+ * Angles use the same axes as the accelerometer only estimate:
+ * main = atan2(z, y), side = atan2(x, y), in Q16.16 degrees. */
+struct tilt_fusion {
+    int32_t main_q16;
+    int32_t side_q16;
+    bool initialized;
+};
+
+void tilt_fusion_reset(struct tilt_fusion *fusion);
+
+/* Acceleration in any consistent unit, angular rate in mdeg/s. */
+void tilt_fusion_update(struct tilt_fusion *fusion, int32_t accel_x, int32_t accel_y,
+                        int32_t accel_z, int32_t gyro_x, int32_t gyro_z, uint32_t dt_us);
+
+static inline int16_t tilt_fusion_main_deg(const struct tilt_fusion *fusion) {
+    return (int16_t)(fusion->main_q16 / 65536);
+}
+
+static inline int16_t tilt_fusion_side_deg(const struct tilt_fusion *fusion) {
+    return (int16_t)(fusion->side_q16 / 65536);
+}
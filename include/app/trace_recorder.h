@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <zephyr/toolchain.h>
+
+/*
+ * Raw accelerometer recording into trace_partition.
+ *
+ * The partition holds a sequence of TRACE_RECORDER_BLOCK_SIZE blocks, each
+ * starting with a little endian struct trace_block_header. The first sample
+ * of a block is stored in the header, every following sample is a bit packed
+ * (LSB first) sequence of order-0 Exp-Golomb codes of the zigzag encoded
+ * differences: timestamp - previous - period_ms, then x, y and z against the
+ * previous sample. Axes are stored right shifted by `shift`. A recording ends
+ * at the first block with a different session or magic.
+ */
+
+#define TRACE_RECORDER_BLOCK_SIZE 1024
+#define TRACE_RECORDER_MAGIC 0x5254
+
+struct trace_block_header {
+    uint16_t magic;
+    uint16_t session;
+    uint32_t timestamp;
+    int16_t x;
+    int16_t y;
+    int16_t z;
+    uint16_t sample_count;
+    uint8_t shift;
+    uint8_t reserved;
+    uint16_t period_ms;
+} __packed;
+
+#ifdef CONFIG_APP_TRACE_RECORDER
+
+int trace_recorder_start(void);
+void trace_recorder_stop(void);
+bool trace_recorder_is_recording(void);
+
+/* Cheap, called for every sample on the sampling path. */
+void trace_recorder_add(int32_t timestamp, int16_t x, int16_t y, int16_t z);
+
+/* Reads back the last recording. Returns number of bytes read, 0 at the end
+ * or negative errno. */
+int trace_recorder_read(size_t offset, uint8_t *buf, size_t len);
+
+#else
+
+static inline void trace_recorder_add(int32_t timestamp, int16_t x, int16_t y, int16_t z) {
+    (void)timestamp;
+    (void)x;
+    (void)y;
+    (void)z;
+}
+
+#endif
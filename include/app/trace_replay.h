@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "posture_detection.h"
+#include "telemetry_storage.h"
+
+/* Event reporting for trace replay runs on native_sim. Compiles to nothing
+ * otherwise. */
+
+#ifdef CONFIG_APP_TRACE_REPLAY
+
+void trace_replay_sample_begin(void);
+void trace_replay_sample_end(void);
+/* Brackets the angle and movement math of one published window */
+void trace_replay_window_begin(void);
+void trace_replay_window_end(void);
+void trace_replay_on_state(enum posture_state state);
+void trace_replay_on_vibration(bool on);
+void trace_replay_on_telemetry(const struct telemetry *telemetry);
+/* Prints the summary and terminates the simulation. */
+void trace_replay_finish(void);
+
+#else
+
+static inline void trace_replay_sample_begin(void) {}
+static inline void trace_replay_sample_end(void) {}
+static inline void trace_replay_window_begin(void) {}
+static inline void trace_replay_window_end(void) {}
+static inline void trace_replay_on_state(enum posture_state state) { (void)state; }
+static inline void trace_replay_on_vibration(bool on) { (void)on; }
+static inline void trace_replay_on_telemetry(const struct telemetry *telemetry) {
+    (void)telemetry;
+}
+static inline void trace_replay_finish(void) {}
+
+#endif
@@ -0,0 +1,266 @@
+/*
+ * Fuzz target and benchmark for command_protocol_process().
+ *
+ * Built with clang and -DHOST_FUZZ=ON this is a libFuzzer target. Otherwise
+ * main() feeds it a fixed set of edge cases and pseudo random writes, which
+ * is what ctest runs, and "bench" times a typical multi-command write.
+ *
+ * Every input is checked against an independent walk over the frames: one
+ * reply per frame in order, replies well formed, handlers only called with
+ * lengths inside their table bounds, truncated writes end in MALFORMED.
+ */
+#include "app/command_protocol.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TABLE_LEN 0x30
+#define MAX_WRITE 600
+#define MAX_REPLIES MAX_WRITE
+
+#define RANDOM_WRITES 2000000
+#define BENCH_WRITES 5000000
+
+struct reply {
+	uint8_t opcode;
+	uint8_t status;
+	size_t len;
+};
+
+static struct {
+	struct reply replies[MAX_REPLIES];
+	size_t count;
+	unsigned handler_calls;
+} ctx;
+
+static unsigned failures;
+
+#define CHECK(cond, ...)                                                                           \
+	do {                                                                                       \
+		if (!(cond)) {                                                                     \
+			printf(__VA_ARGS__);                                                       \
+			printf("\n");                                                              \
+			failures++;                                                                \
+			return;                                                                    \
+		}                                                                                  \
+	} while (0)
+
+static void record_reply(const uint8_t *buf, size_t len) {
+	if (ctx.count >= MAX_REPLIES || len < 2 || len > 2 + CMD_RESPONSE_PAYLOAD_MAX) {
+		printf("bad reply length %zu\n", len);
+		failures++;
+		return;
+	}
+	ctx.replies[ctx.count++] = (struct reply){buf[0], buf[1], len};
+}
+
+/* Echoes the payload back, truncated to what fits a reply */
+static enum cmd_status echo(const uint8_t *payload, uint8_t len, struct cmd_response *rsp) {
+	ctx.handler_calls++;
+	rsp->len = len < CMD_RESPONSE_PAYLOAD_MAX ? len : CMD_RESPONSE_PAYLOAD_MAX;
+	memcpy(rsp->payload, payload, rsp->len);
+	return CMD_STATUS_OK;
+}
+
+/* Fails on odd first bytes, otherwise claims an oversized response */
+static enum cmd_status picky(const uint8_t *payload, uint8_t len, struct cmd_response *rsp) {
+	ctx.handler_calls++;
+	rsp->len = 0xFF;
+	return len > 0 && (payload[0] & 1) ? CMD_STATUS_BAD_VALUE : CMD_STATUS_OK;
+}
+
+static enum cmd_status empty(const uint8_t *payload, uint8_t len, struct cmd_response *rsp) {
+	(void)payload;
+	(void)len;
+	(void)rsp;
+	ctx.handler_calls++;
+	return CMD_STATUS_OK;
+}
+
+/* Shaped like the firmware table: fixed lengths, ranges and holes */
+static const struct cmd_def table[TABLE_LEN] = {
+	[0x01] = {empty, 0, 0},	  [0x02] = {echo, 0, 0},   [0x03] = {echo, 1, 1},
+	[0x04] = {picky, 1, 1},	  [0x05] = {echo, 1, 1},   [0x07] = {empty, 0, 0},
+	[0x08] = {echo, 1, 1},	  [0x09] = {echo, 2, 2},   [0x0A] = {echo, 0, 0},
+	[0x10] = {empty, 0, 0},	  [0x11] = {empty, 0, 0},  [0x12] = {picky, 4, 4},
+	[0x20] = {echo, 0, 255},  [0x21] = {picky, 0, 32}, [0x22] = {echo, 16, 255},
+};
+
+static void check_write(const uint8_t *data, size_t len) {
+	ctx.count = 0;
+	ctx.handler_calls = 0;
+	int handled = command_protocol_process(table, TABLE_LEN, data, len, record_reply);
+
+	size_t pos = 0;
+	size_t frame = 0;
+	unsigned expected_calls = 0;
+	while (pos < len) {
+		uint8_t opcode = data[pos];
+		CHECK(frame < ctx.count, "frame %zu at %zu got no reply", frame, pos);
+		const struct reply *reply = &ctx.replies[frame];
+		CHECK(reply->opcode == (opcode | CMD_RESPONSE_FLAG),
+		      "frame %zu: reply opcode %02x for %02x", frame, reply->opcode, opcode);
+
+		if (len - pos < 2 || len - pos - 2 < data[pos + 1]) {
+			CHECK(reply->status == CMD_STATUS_MALFORMED && reply->len == 2,
+			      "frame %zu: truncated, status %u", frame, reply->status);
+			CHECK(handled == -EBADMSG && ctx.count == frame + 1,
+			      "truncated write returned %d with %zu replies", handled, ctx.count);
+			CHECK(ctx.handler_calls == expected_calls, "handler ran on a truncated frame");
+			return;
+		}
+
+		uint8_t payload_len = data[pos + 1];
+		const struct cmd_def *def = opcode < TABLE_LEN ? &table[opcode] : NULL;
+		if (def == NULL || def->handler == NULL) {
+			CHECK(reply->status == CMD_STATUS_UNKNOWN_OPCODE, "frame %zu: opcode %02x status %u",
+			      frame, opcode, reply->status);
+		} else if (payload_len < def->min_len || payload_len > def->max_len) {
+			CHECK(reply->status == CMD_STATUS_BAD_LENGTH, "frame %zu: length %u status %u",
+			      frame, payload_len, reply->status);
+		} else {
+			expected_calls++;
+			// picky claims more payload than a reply holds, that must fail
+			enum cmd_status expected = def->handler != picky ? CMD_STATUS_OK
+						   : payload_len > 0 && (data[pos + 2] & 1)
+							   ? CMD_STATUS_BAD_VALUE
+							   : CMD_STATUS_FAILED;
+			CHECK(reply->status == expected, "frame %zu: handler status %u, expected %u",
+			      frame, reply->status, expected);
+		}
+		CHECK(reply->status == CMD_STATUS_OK || reply->len == 2,
+		      "frame %zu: error reply carries a payload", frame);
+
+		pos += 2 + payload_len;
+		frame++;
+	}
+	CHECK(handled == (int)frame && ctx.count == frame, "returned %d, %zu replies, %zu frames",
+	      handled, ctx.count, frame);
+	CHECK(ctx.handler_calls == expected_calls, "%u handler calls, expected %u",
+	      ctx.handler_calls, expected_calls);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	if (size > MAX_WRITE) {
+		return 0;
+	}
+	check_write(data, size);
+	if (failures != 0) {
+		abort();
+	}
+	return 0;
+}
+
+#ifndef HOST_FUZZ
+
+static uint32_t rng_state = 0x9E3779B9u;
+
+static uint32_t rng_next(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+/* Mostly valid frames with a few broken ones, pure noise finds little */
+static size_t random_write(uint8_t *buf) {
+	size_t len = 0;
+	size_t frames = rng_next() % 8;
+	for (size_t i = 0; i < frames; i++) {
+		uint8_t opcode = rng_next() % 4 == 0 ? (uint8_t)rng_next() : rng_next() % 0x24;
+		uint8_t payload_len = rng_next() % 4 == 0 ? (uint8_t)rng_next() : rng_next() % 5;
+		if (len + 2 + payload_len > MAX_WRITE) {
+			break;
+		}
+		buf[len++] = opcode;
+		buf[len++] = payload_len;
+		for (uint8_t j = 0; j < payload_len; j++) {
+			buf[len++] = (uint8_t)rng_next();
+		}
+	}
+	// Cut the write short now and then
+	if (len > 0 && rng_next() % 8 == 0) {
+		len -= 1 + rng_next() % len;
+	}
+	return len;
+}
+
+static void run_edge_cases(void) {
+	const struct {
+		const uint8_t *data;
+		size_t len;
+	} cases[] = {
+		{(const uint8_t[]){0}, 0},
+		{(const uint8_t[]){0x01}, 1},
+		{(const uint8_t[]){0x01, 0x00}, 2},
+		{(const uint8_t[]){0x01, 0x01}, 2},
+		{(const uint8_t[]){0x03, 0x01, 0x05, 0x01, 0x00}, 5},
+		{(const uint8_t[]){0x03, 0x00, 0x03, 0x02, 0x01, 0x02}, 6},
+		{(const uint8_t[]){0xFF, 0x00, 0x00, 0x00, 0x06, 0x00}, 6},
+		{(const uint8_t[]){0x12, 0x04, 1, 2, 3, 4, 0x12, 0x04, 2, 2, 3}, 11},
+		{(const uint8_t[]){0x20, 0xFF}, 2},
+	};
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		check_write(cases[i].data, cases[i].len);
+	}
+
+	// Longest payload the length byte allows
+	static uint8_t big[2 + 255];
+	big[0] = 0x20;
+	big[1] = 255;
+	check_write(big, sizeof(big));
+	check_write(big, sizeof(big) - 1);
+}
+
+static void discard_reply(const uint8_t *buf, size_t len) {
+	(void)buf;
+	(void)len;
+}
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench(void) {
+	// What a phone app sends on connect: state, settings, link, two stats pages
+	static const uint8_t write[] = {0x01, 0x00, 0x02, 0x00, 0x07, 0x00,
+					0x08, 0x01, 0x00, 0x09, 0x02, 0x00, 0x00};
+	int commands = 0;
+
+	double start = now_ns();
+	for (unsigned i = 0; i < BENCH_WRITES; i++) {
+		commands += command_protocol_process(table, TABLE_LEN, write, sizeof(write),
+						     discard_reply);
+	}
+	double elapsed = now_ns() - start;
+	printf("bench: %d commands, %.1f ns/write, %.1f ns/command\n", commands,
+	       elapsed / BENCH_WRITES, elapsed / commands);
+}
+
+int main(int argc, char **argv) {
+	if (argc == 2 && strcmp(argv[1], "bench") == 0) {
+		bench();
+		return 0;
+	}
+
+	run_edge_cases();
+	static uint8_t buf[MAX_WRITE];
+	for (unsigned i = 0; i < RANDOM_WRITES && failures == 0; i++) {
+		check_write(buf, random_write(buf));
+	}
+	if (failures != 0) {
+		printf("FAIL: %u mismatches\n", failures);
+		return 1;
+	}
+	printf("PASS: %u random writes\n", RANDOM_WRITES);
+	return 0;
+}
+
+#endif /* HOST_FUZZ */
@@ -0,0 +1,204 @@
+/*
+ * Checks fixed_atan2_q16() and fixed_isqrt() against libm and prints their
+ * cost next to the float versions. Run with "bench" as the only argument to
+ * get the timings only.
+ */
+#include "app/fixed_math.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PI 3.14159265358979323846
+
+// Documented bound in fixed_math.h
+#define ATAN2_MAX_ERROR_DEG 0.01
+
+// Accelerometer axes in mm/s^2, averages of the window stay inside int16
+#define AXIS_MAX 32767
+
+#define RANDOM_PAIRS 2000000
+#define BENCH_CALLS 10000000
+
+static unsigned failures;
+
+static uint32_t rng_state = 0x12345678u;
+
+static uint32_t rng_next(void) {
+  // xorshift32, reproducible across hosts
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+static int32_t rng_axis(void) {
+  return (int32_t)(rng_next() % (2 * AXIS_MAX + 1)) - AXIS_MAX;
+}
+
+static double angle_error_deg(int32_t y, int32_t x, double *worst) {
+  double fixed = fixed_atan2_q16(y, x) / 65536.0;
+  double ref = atan2f((float)y, (float)x) * (180.0 / PI);
+  double error = fabs(fixed - ref);
+  // +180 and -180 are the same direction
+  if (error > 180.0) {
+    error = 360.0 - error;
+  }
+  if (error > *worst) {
+    *worst = error;
+  }
+  return error;
+}
+
+static void check_atan2(void) {
+  double worst = 0;
+  unsigned checked = 0;
+
+  // Every 0.1 deg on circles from a few mm/s^2 up to the full axis range
+  static const int32_t radii[] = {3, 10, 100, 1000, 9807, 20000, AXIS_MAX};
+  for (size_t r = 0; r < sizeof(radii) / sizeof(radii[0]); r++) {
+    for (int tenth = -1800; tenth < 1800; tenth++) {
+      double a = tenth / 10.0 * PI / 180.0;
+      int32_t x = (int32_t)lround(radii[r] * cos(a));
+      int32_t y = (int32_t)lround(radii[r] * sin(a));
+      if (x == 0 && y == 0) {
+        continue;
+      }
+      double error = angle_error_deg(y, x, &worst);
+      checked++;
+      if (error > ATAN2_MAX_ERROR_DEG) {
+        printf("atan2(%d, %d): error %.5f deg\n", y, x, error);
+        failures++;
+      }
+    }
+  }
+
+  for (unsigned i = 0; i < RANDOM_PAIRS; i++) {
+    int32_t x = rng_axis();
+    int32_t y = rng_axis();
+    if (x == 0 && y == 0) {
+      continue;
+    }
+    double error = angle_error_deg(y, x, &worst);
+    checked++;
+    if (error > ATAN2_MAX_ERROR_DEG) {
+      printf("atan2(%d, %d): error %.5f deg\n", y, x, error);
+      failures++;
+    }
+  }
+
+  // Axes and the origin are special cased
+  if (fixed_atan2_q16(0, 0) != 0 || fixed_atan2_q16(1, 0) != 90 << 16 ||
+      fixed_atan2_q16(-1, 0) != -(90 << 16)) {
+    printf("atan2 special cases wrong\n");
+    failures++;
+  }
+  if (fixed_atan2_deg(-1, -AXIS_MAX) != -179 || fixed_atan2_deg(0, AXIS_MAX) != 0) {
+    printf("atan2 whole degree truncation wrong\n");
+    failures++;
+  }
+
+  printf("atan2: %u inputs, worst error %.5f deg (bound %.2f)\n", checked, worst,
+         ATAN2_MAX_ERROR_DEG);
+}
+
+static void check_isqrt_value(uint32_t value) {
+  uint64_t root = fixed_isqrt(value);
+  // floor(sqrt(value)) exactly, sqrtf rounds above 2^24
+  if (root * root > value || (root + 1) * (root + 1) <= value) {
+    printf("isqrt(%u) = %u\n", value, (unsigned)root);
+    failures++;
+    return;
+  }
+  if (fabsf(sqrtf((float)value) - (float)root) >= 1.0f + (float)root * 1e-6f) {
+    printf("isqrt(%u) = %u, sqrtf %.3f\n", value, (unsigned)root, sqrtf((float)value));
+    failures++;
+  }
+}
+
+static void check_isqrt(void) {
+  unsigned checked = 0;
+
+  for (uint32_t value = 0; value < (1u << 20); value++) {
+    check_isqrt_value(value);
+    checked++;
+  }
+  // Both sides of every perfect square in the uint16 result range
+  for (uint32_t root = 1; root <= UINT16_MAX; root++) {
+    check_isqrt_value(root * root);
+    check_isqrt_value(root * root - 1);
+    checked += 2;
+  }
+  check_isqrt_value(UINT32_MAX);
+  for (unsigned i = 0; i < RANDOM_PAIRS; i++) {
+    check_isqrt_value(rng_next());
+  }
+  checked += 1 + RANDOM_PAIRS;
+
+  printf("isqrt: %u inputs\n", checked);
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Host timings only rank the variants, the target has no FPU in the path
+static void bench(void) {
+  static int32_t xs[1024];
+  static int32_t ys[1024];
+  volatile int64_t sink = 0;
+
+  for (unsigned i = 0; i < 1024; i++) {
+    xs[i] = rng_axis();
+    ys[i] = rng_axis();
+  }
+
+  double start = now_ns();
+  for (unsigned i = 0; i < BENCH_CALLS; i++) {
+    sink += fixed_atan2_q16(ys[i & 1023], xs[i & 1023]);
+  }
+  double fixed_atan2 = (now_ns() - start) / BENCH_CALLS;
+
+  start = now_ns();
+  for (unsigned i = 0; i < BENCH_CALLS; i++) {
+    sink += (int64_t)(atan2f((float)ys[i & 1023], (float)xs[i & 1023]) * 1000);
+  }
+  double float_atan2 = (now_ns() - start) / BENCH_CALLS;
+
+  start = now_ns();
+  for (unsigned i = 0; i < BENCH_CALLS; i++) {
+    sink += fixed_isqrt((uint32_t)(xs[i & 1023] * xs[i & 1023]));
+  }
+  double fixed_sqrt = (now_ns() - start) / BENCH_CALLS;
+
+  start = now_ns();
+  for (unsigned i = 0; i < BENCH_CALLS; i++) {
+    sink += (int64_t)sqrtf((float)(xs[i & 1023] * xs[i & 1023]));
+  }
+  double float_sqrt = (now_ns() - start) / BENCH_CALLS;
+
+  printf("bench ns/call: fixed_atan2_q16 %.1f atan2f %.1f fixed_isqrt %.1f sqrtf %.1f\n",
+         fixed_atan2, float_atan2, fixed_sqrt, float_sqrt);
+  (void)sink;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 2 && strcmp(argv[1], "bench") == 0) {
+    bench();
+    return 0;
+  }
+
+  check_atan2();
+  check_isqrt();
+  if (failures != 0) {
+    printf("FAIL: %u mismatches\n", failures);
+    return 1;
+  }
+  printf("PASS\n");
+  return 0;
+}